@@ -69,37 +69,103 @@ int DoubleErrorFunc(lua::State L) {
 	L.PCall(1, 1);
 	return 1;
 }
-int __cdecl debug_lua::Hooks::PCallOverride(lua_State* l, int nargs, int nresults, int errfunc)
+
+// callers of the currently running pcalls, only the calling function gets stored.
+// it is always level 0 when pcall gets called, so getting it does not walk the stack (the stack depth would, on every pcall).
+// its level and debug info are only needed if an error actually happens, so they get looked up from there.
+// lua only runs in the shok thread, so no synchronization needed.
+struct PCallFrame {
+	lua_State* L;
+	const void* Caller; // nullptr if pcall did not get called from a running function (directly from the engine)
+};
+static constexpr int MaxPCallFrames = 256;
+static PCallFrame PCallFrames[MaxPCallFrames]{};
+// may be larger than MaxPCallFrames, the ones above it are not stored
+static int PCallFrameCount = 0;
+
+// returns the frame count to restore after the pcall.
+// restoring instead of popping also cleans up frames of pcalls that never returned (yielded over with a continuation).
+static int PushPCallFrame(lua::State L)
 {
-	lua::State L{ l };
-	int ehsi = 0;
-	lua::DebugInfo di{};
-	if (ErrorCallback) {
-		bool valid = L.Debug_GetStack(0, di, lua::DebugInfoOptions::Name | lua::DebugInfoOptions::Source, false);
-		if (errfunc != 0) {
-			L.PushValue(errfunc);
-			if (valid)
-				L.PushLightUserdata(&di);
-			else
-				L.Push();
-			L.Push(ErrorCallback, 1);
-			L.Push<DoubleErrorFunc>(2);
+	int r = PCallFrameCount;
+	if (PCallFrameCount < MaxPCallFrames) {
+		const void* caller = nullptr;
+		lua::DebugInfo i{};
+		if (L.Debug_GetStack(0, i, lua::DebugInfoOptions::Source, true)) {
+			caller = L.ToPointer(-1);
+			L.Pop(1);
 		}
-		else {
-			if (valid)
-				L.PushLightUserdata(&di);
-			else
-				L.Push();
-			L.Push(ErrorCallback, 1);
+		PCallFrames[PCallFrameCount] = PCallFrame{ L.GetState(), caller };
+	}
+	++PCallFrameCount;
+	return r;
+}
+
+// the handler without a chained errfunc gets created once and then reused from the registry (keyed by ErrorCallback).
+// with errfunc, a new closure is still needed to chain both.
+static int InsertErrorHandler(lua::State L, int nargs, int errfunc)
+{
+	if (errfunc != 0)
+		L.PushValue(errfunc);
+	void* key = reinterpret_cast<void*>(debug_lua::Hooks::ErrorCallback);
+	L.PushLightUserdata(key);
+	L.GetTableRaw(L.REGISTRYINDEX);
+	if (!L.IsFunction(-1)) {
+		L.Pop(1);
+		L.Push(debug_lua::Hooks::ErrorCallback, 0);
+		L.PushLightUserdata(key);
+		L.PushValue(-2);
+		L.SetTableRaw(L.REGISTRYINDEX);
+	}
+	if (errfunc != 0)
+		L.Push<DoubleErrorFunc>(2);
+	int ehsi = L.ToAbsoluteIndex(-nargs - 2);
+	L.Insert(ehsi);
+	return ehsi;
+}
+
+int debug_lua::Hooks::PCallCallerLevel(lua_State* l)
+{
+	// the innermost pcalls are not stored, an outer one would give a wrong level
+	if (PCallFrameCount > MaxPCallFrames)
+		return -1;
+	for (int i = PCallFrameCount - 1; i >= 0; --i) {
+		if (PCallFrames[i].L == l) {
+			if (PCallFrames[i].Caller == nullptr)
+				return -1;
+			// the caller is a c function (pcall/xpcall or the engine), they call pcall right away.
+			// so the innermost frame running it is the one that did the innermost pcall.
+			lua::State L{ l };
+			lua::DebugInfo di{};
+			for (int lvl = 0; L.Debug_GetStack(lvl, di, lua::DebugInfoOptions::Source, true); ++lvl) {
+				const void* f = L.ToPointer(-1);
+				L.Pop(1);
+				if (f == PCallFrames[i].Caller)
+					return lvl;
+			}
+			return -1;
 		}
-		ehsi = L.ToAbsoluteIndex(-nargs - 2);
-		L.Insert(ehsi);
-		errfunc = ehsi;
 	}
-	int r = pcall_recovered(l, nargs, nresults, errfunc);
-	if (ErrorCallback) {
-		L.Remove(ehsi);
+	return -1;
+}
+
+int __cdecl debug_lua::Hooks::PCallOverride(lua_State* l, int nargs, int nresults, int errfunc)
+{
+	if (!ErrorCallback) {
+		int r = pcall_recovered(l, nargs, nresults, errfunc);
+		if (r != 0)
+			++PCallErrors;
+		return r;
 	}
+
+	lua::State L{ l };
+	int frames = PushPCallFrame(L);
+	int ehsi = InsertErrorHandler(L, nargs, errfunc);
+	int r = pcall_recovered(l, nargs, nresults, ehsi);
+	L.Remove(ehsi);
+	PCallFrameCount = frames;
+	if (r != 0)
+		++PCallErrors;
 	return r;
 }
 
@@ -134,41 +200,28 @@ int __cdecl debug_lua::Hooks::LoadOverride_Dbg(lua_State* L, void* reader, void*
 
 int __cdecl debug_lua::Hooks::PCallOverride_Dbg(lua_State* l, int nargs, int nresults, int errfunc, ptrdiff_t* ctx, void* k)
 {
-	lua::State L{ l };
-	int ehsi = 0;
-	lua::DebugInfo di{};
-	if (ErrorCallback) {
-		bool valid = L.Debug_GetStack(0, di, lua::DebugInfoOptions::Name | lua::DebugInfoOptions::Source, false);
-		if (errfunc != 0) {
-			L.PushValue(errfunc);
-			if (valid)
-				L.PushLightUserdata(&di);
-			else
-				L.Push();
-			L.Push(ErrorCallback, 1);
-			L.Push<DoubleErrorFunc>(2);
-		}
-		else {
-			if (valid)
-				L.PushLightUserdata(&di);
-			else
-				L.Push();
-			L.Push(ErrorCallback, 1);
-		}
-		ehsi = L.ToAbsoluteIndex(-nargs - 2);
-		L.Insert(ehsi);
-		errfunc = ehsi;
-	}
-	int r = lua_pcallk_real(l, nargs, nresults, errfunc, ctx, k);
-	if (ErrorCallback) {
-		L.Remove(ehsi);
+	if (!ErrorCallback) {
+		int r = lua_pcallk_real(l, nargs, nresults, errfunc, ctx, k);
+		if (r != 0)
+			++PCallErrors;
+		return r;
 	}
+
+	lua::State L{ l };
+	int frames = PushPCallFrame(L);
+	int ehsi = InsertErrorHandler(L, nargs, errfunc);
+	int r = lua_pcallk_real(l, nargs, nresults, ehsi, ctx, k);
+	L.Remove(ehsi);
+	PCallFrameCount = frames;
+	if (r != 0)
+		++PCallErrors;
 	return r;
 }
 
 std::function<void()> debug_lua::Hooks::RunCallback{};
 int(*debug_lua::Hooks::ErrorCallback)(lua_State* L) = nullptr;
 void(*debug_lua::Hooks::SyntaxCallback)(lua_State* L, int err) = nullptr;
+unsigned int debug_lua::Hooks::PCallErrors = 0;
 bool Hooked = false;
 void debug_lua::Hooks::InstallHook()
 {
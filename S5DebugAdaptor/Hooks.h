@@ -22,8 +22,13 @@ namespace debug_lua {
 		static std::function<void()> RunCallback;
 		static int(*ErrorCallback)(lua_State* L);
 		static void (*SyntaxCallback)(lua_State* L, int err);
+		// counts pcalls that caught an error. the stack got unwound without return hooks, so tracked call depths are wrong after it changed.
+		static unsigned int PCallErrors;
 
 		static void SendCheckRun();
+		// level of the function that called the innermost running pcall of L, -1 if unknown (also while more than 256 pcalls are nested).
+		// only valid while ErrorCallback is set, meant to be called from it.
+		static int PCallCallerLevel(lua_State* L);
 
 
 		static void RedirectCall(void* call, void* redirect);
@@ -1,9 +1,41 @@
 #include "pch.h"
 #include "adaptor.h"
-#include <uni_algo/case.h>
+#include <algorithm>
+#include <charconv>
 #include "shok.h"
 #include "utility.h"
 
+namespace dap {
+	DAP_IMPLEMENT_STRUCT_TYPEINFO_EXT(debug_lua::LaunchRequest, dap::LaunchRequest, "launch",
+		DAP_FIELD(profilerInterval, "profilerInterval"));
+	DAP_IMPLEMENT_STRUCT_TYPEINFO_EXT(debug_lua::AttachRequest, dap::AttachRequest, "attach",
+		DAP_FIELD(profilerInterval, "profilerInterval"));
+	DAP_IMPLEMENT_STRUCT_TYPEINFO(debug_lua::ProfilerResponse, "",
+		DAP_FIELD(running, "running"),
+		DAP_FIELD(samples, "samples"),
+		DAP_FIELD(dropped, "dropped"),
+		DAP_FIELD(data, "data"));
+	DAP_IMPLEMENT_STRUCT_TYPEINFO(debug_lua::ProfilerRequest, "s5profiler",
+		DAP_FIELD(command, "command"),
+		DAP_FIELD(format, "format"),
+		DAP_FIELD(interval, "interval"));
+	DAP_IMPLEMENT_STRUCT_TYPEINFO(debug_lua::CallProfileFunction, "",
+		DAP_FIELD(name, "name"),
+		DAP_FIELD(calls, "calls"),
+		DAP_FIELD(inclusive, "inclusive"),
+		DAP_FIELD(exclusive, "exclusive"));
+	DAP_IMPLEMENT_STRUCT_TYPEINFO(debug_lua::CallProfileState, "",
+		DAP_FIELD(threadId, "threadId"),
+		DAP_FIELD(name, "name"),
+		DAP_FIELD(functions, "functions"));
+	DAP_IMPLEMENT_STRUCT_TYPEINFO(debug_lua::CallProfileResponse, "",
+		DAP_FIELD(running, "running"),
+		DAP_FIELD(states, "states"));
+	DAP_IMPLEMENT_STRUCT_TYPEINFO(debug_lua::CallProfileRequest, "s5callprofile",
+		DAP_FIELD(command, "command"),
+		DAP_FIELD(threadId, "threadId"));
+}
+
 debug_lua::Adaptor::Adaptor(Debugger& d, const std::shared_ptr<dap::ReaderWriter>& socket) : Dbg(d)
 {
 	Session->registerHandler([&](const dap::InitializeRequest& r) {
@@ -14,6 +46,9 @@ debug_lua::Adaptor::Adaptor(Debugger& d, const std::shared_ptr<dap::ReaderWriter
 		response.supportsConfigurationDoneRequest = true;
 		response.supportsSetVariable = true;
 		response.supportsLoadedSourcesRequest = true;
+		response.supportsConditionalBreakpoints = true;
+		response.supportsHitConditionalBreakpoints = true;
+		response.supportsLogPoints = true;
 		response.exceptionBreakpointFilters = dap::array<dap::ExceptionBreakpointsFilter>{};
 		{
 			dap::ExceptionBreakpointsFilter f{};
@@ -68,15 +103,34 @@ debug_lua::Adaptor::Adaptor(Debugger& d, const std::shared_ptr<dap::ReaderWriter
 		});
 
 	Session->registerHandler(
-		[&](const dap::StackTraceRequest& request)
-		-> dap::ResponseOrError<dap::StackTraceResponse> {
-			auto c = LuaExecutionPackagedTask<dap::StackTraceResponse>{ [this, request]() {
+		[&](const dap::StackTraceRequest& request, const Responder<dap::StackTraceResponse>& respond) {
+			int first = static_cast<int>(request.startFrame.value(0));
+			int levels = static_cast<int>(request.levels.value(0)); // 0 is all
+			{
+				// same stop, answer without bothering the shok thread
+				std::lock_guard<std::mutex> lock(FrameCacheMutex);
+				auto it = FrameCache.find(static_cast<int>(request.threadId));
+				if (it != FrameCache.end()) {
+					auto r = it->second.Get(first, levels);
+					if (r.has_value()) {
+						respond(*r);
+						return;
+					}
+				}
+			}
+			RunPipelined(respond, std::format("Unknown threadId '{}'", int(request.threadId)), [this, request, first, levels]() {
 				auto& l = Dbg.GetState(reinterpret_cast<lua_State*>(int(request.threadId)));
 				lua::State L{ l.L };
-				int lvl = 0;
+
+				std::lock_guard<std::mutex> lock(FrameCacheMutex);
+				auto& c = FrameCache[static_cast<int>(request.threadId)];
+				if (c.Total < 0)
+					c.Total = L.Debug_GetStackDepth();
+				int last = levels > 0 ? std::min(c.Total, first + levels) : c.Total;
+
+				int lvl = static_cast<int>(c.Frames.size());
 				lua::DebugInfo i{};
-				dap::StackTraceResponse response;
-				while (L.Debug_GetStack(lvl, i, lua::DebugInfoOptions::Line | lua::DebugInfoOptions::Name |
+				while (lvl < last && L.Debug_GetStack(lvl, i, lua::DebugInfoOptions::Line | lua::DebugInfoOptions::Name |
 					lua::DebugInfoOptions::Source, false)) {
 
 					dap::StackFrame frame;
@@ -98,72 +152,62 @@ debug_lua::Adaptor::Adaptor(Debugger& d, const std::shared_ptr<dap::ReaderWriter
 
 					frame.line = i.CurrentLine;
 					frame.column = 1;
-					auto fid = EncodeStackFrame(l, lvl, Scope::None, 0);
+					auto fid = EncodeStackFrame(l, lvl);
 					if (!fid.has_value())
 						break;
 					frame.id = *fid;
 
-					response.stackFrames.push_back(frame);
+					c.Frames.push_back(frame);
 					++lvl;
 				}
-				response.totalFrames = response.stackFrames.size();
-				return response;
-			} };
-			Dbg.RunInSHoKThread(c);
-			try {
-				return c.Get();
-			}
-			catch (const std::invalid_argument&) {
-				return dap::Error("Unknown threadId '%d'", int(request.threadId));
-			}
-			catch (const lua::LuaException& e) {
-				return dap::Error("Lua error: '%s'", e.what());
-			}
+				if (lvl < last) // stack ended early or frame id overflow
+					c.Total = lvl;
+
+				auto r = c.Get(first, levels);
+				return r.value_or(dap::StackTraceResponse{});
+			});
 		});
 
-	Session->registerHandler([&](const dap::ScopesRequest& request)
-		-> dap::ResponseOrError<dap::ScopesResponse> {
-			auto c = LuaExecutionPackagedTask<dap::ScopesResponse>{ [this, request]() {
-				auto [s, lvl, sc, var] = DecodeStackFrame(static_cast<int>(request.frameId));
+	Session->registerHandler([&](const dap::ScopesRequest& request, const Responder<dap::ScopesResponse>& respond) {
+			RunPipelined(respond, std::format("Unknown frameId '{}'", int(request.frameId)), [this, request]() {
+				auto [s, lvl] = DecodeStackFrame(static_cast<int>(request.frameId));
 				dap::ScopesResponse response;
 				{
 					dap::Scope scope;
 					scope.name = "Locals";
 					scope.presentationHint = "locals";
-					scope.variablesReference = *EncodeStackFrame(s, lvl, Scope::Local, 0);
+					scope.variablesReference = ScopeReference(s, lvl, Scope::Local);
 					response.scopes.push_back(scope);
 				}
 				{
 					dap::Scope scope;
 					scope.name = "Upvalues";
 					scope.presentationHint = "locals";
-					scope.variablesReference = *EncodeStackFrame(s, lvl, Scope::Upvalue, 0);
+					scope.variablesReference = ScopeReference(s, lvl, Scope::Upvalue);
 					response.scopes.push_back(scope);
 				}
 				return response;
-				} };
-			Dbg.RunInSHoKThread(c);
-			try {
-				return c.Get();
-			}
-			catch (const std::invalid_argument&) {
-				return dap::Error("Unknown frameId '%d'", int(request.frameId));
-			}
-			catch (const lua::LuaException& e) {
-				return dap::Error("Lua error: '%s'", e.what());
-			}
+				});
 		});
 
-	Session->registerHandler([&](const dap::VariablesRequest& request)
-		-> dap::ResponseOrError<dap::VariablesResponse> {
-			auto c = LuaExecutionPackagedTask<dap::VariablesResponse>{ [this, request]() {
-				auto [s, lvl, sc, var] = DecodeStackFrame(static_cast<int>(request.variablesReference));
+	Session->registerHandler([&](const dap::VariablesRequest& request, const Responder<dap::VariablesResponse>& respond) {
+			RunPipelined(respond, std::format("Unknown variablesReference '{}'", int(request.variablesReference)), [this, request]() {
+				VariableHandle h = GetVariableHandle(static_cast<int>(request.variablesReference)); // copy, pinning more values may move it
+				auto& s = Dbg.GetState(h.State);
+				int lvl = h.Level;
 				lua::State L{ s.L };
 				lua::DebugInfo i{};
 				dap::VariablesResponse response;
 
 				int t = L.GetTop();
 
+				if (h.Sc == Scope::None) {
+					PushPinnedValue(L, static_cast<int>(request.variablesReference));
+					ListChildren(s, L, -1, static_cast<int>(request.variablesReference), lvl, request, response.variables);
+					L.SetTop(t);
+					return response;
+				}
+
 				if (!L.Debug_GetStack(lvl, i, lua::DebugInfoOptions::Source, true)) {
 					L.SetTop(t);
 					throw std::invalid_argument{ "invalid stack lvl" };
@@ -175,130 +219,67 @@ debug_lua::Adaptor::Adaptor(Debugger& d, const std::shared_ptr<dap::ReaderWriter
 					return response;
 				}
 
-				if (sc == Scope::Local) {
-					if (var == 0) {
-						int num = 1;
-						int tablenum = 1;
-						while (const char* n = L.Debug_GetLocal(lvl, num)) {
-							dap::Variable currentLineVar;
-							currentLineVar.name = EnsureUTF8(n);
-							currentLineVar.type = L.TypeName(L.Type(-1));
-							if (L.IsTable(-1)) {
-								auto ref = EncodeStackFrame(s, lvl, sc, tablenum);
-								if (ref.has_value())
-									currentLineVar.variablesReference = *ref;
-								++tablenum;
-							}
-							currentLineVar.value = EnsureUTF8(L.ToDebugString<Debugger::ToDebugString_Format>(-1, currentLineVar.variablesReference == 0 ? Dbg.MaxTableExpandLevels : 0));
-							L.Pop(1);
-							response.variables.push_back(currentLineVar);
-
-							++num;
-						}
-						L.SetTop(t);
-					}
-					else {
-						int num = 1;
-						int tablenum = 1;
-						while (const char* n = L.Debug_GetLocal(lvl, num)) {
-							if (L.IsTable(-1)) {
-								if (tablenum == var) {
-									for (auto t : L.Pairs(-1)) {
-										dap::Variable currentLineVar;
-										currentLineVar.name = EnsureUTF8(L.ToDebugString<Debugger::ToDebugString_Format>(-2));
-										currentLineVar.type = L.TypeName(L.Type(-1));
-										currentLineVar.value = EnsureUTF8(L.ToDebugString<Debugger::ToDebugString_Format>(-1, Dbg.MaxTableExpandLevels));
-
-										response.variables.push_back(currentLineVar);
-									}
-
-									L.Pop(1);
-									break;
-								}
-
-								++tablenum;
-							}
-							L.Pop(1);
+				if (h.Sc == Scope::Local) {
+					int num = 1;
+					while (const char* n = L.Debug_GetLocal(lvl, num)) {
+						dap::Variable currentLineVar;
+						currentLineVar.name = EnsureUTF8(n);
+						FillVariable(currentLineVar, s, L, -1, lvl);
+						L.Pop(1);
+						response.variables.push_back(currentLineVar);
 
-							++num;
-						}
-						L.SetTop(t);
+						++num;
 					}
 				}
-				else if (sc == Scope::Upvalue) {
-					if (var == 0) {
-						int num = 1;
-						int tablenum = 1;
-						while (const char* n = L.Debug_GetUpvalue(func, num)) {
-							dap::Variable currentLineVar;
-							currentLineVar.name = EnsureUTF8(n);
-							currentLineVar.type = L.TypeName(L.Type(-1));
-							if (L.IsTable(-1)) {
-								auto ref = EncodeStackFrame(s, lvl, sc, tablenum);
-								if (ref.has_value())
-									currentLineVar.variablesReference = *ref;
-								++tablenum;
-							}
-							currentLineVar.value = EnsureUTF8(L.ToDebugString<Debugger::ToDebugString_Format>(-1, currentLineVar.variablesReference == 0 ? Dbg.MaxTableExpandLevels : 0));
-							L.Pop(1);
-							response.variables.push_back(currentLineVar);
-
-							++num;
-						}
-						L.SetTop(t);
-					}
-					else {
-						int num = 1;
-						int tablenum = 1;
-						while (const char* n = L.Debug_GetUpvalue(func, num)) {
-							if (L.IsTable(-1)) {
-								if (tablenum == var) {
-									for (auto t : L.Pairs(-1)) {
-										dap::Variable currentLineVar;
-										currentLineVar.name = EnsureUTF8(L.ToDebugString<Debugger::ToDebugString_Format>(-2));
-										currentLineVar.type = L.TypeName(L.Type(-1));
-										currentLineVar.value = EnsureUTF8(L.ToDebugString<Debugger::ToDebugString_Format>(-1, Dbg.MaxTableExpandLevels));
-
-										response.variables.push_back(currentLineVar);
-									}
-
-									L.Pop(1);
-									break;
-								}
-
-								++tablenum;
-							}
-							L.Pop(1);
+				else if (h.Sc == Scope::Upvalue) {
+					int num = 1;
+					while (const char* n = L.Debug_GetUpvalue(func, num)) {
+						dap::Variable currentLineVar;
+						currentLineVar.name = EnsureUTF8(n);
+						FillVariable(currentLineVar, s, L, -1, lvl);
+						L.Pop(1);
+						response.variables.push_back(currentLineVar);
 
-							++num;
-						}
-						L.SetTop(t);
+						++num;
 					}
 				}
+				L.SetTop(t);
 
 				return response;
-				} };
-			Dbg.RunInSHoKThread(c);
-			try {
-				return c.Get();
-			}
-			catch (const std::invalid_argument&) {
-				return dap::Error("Unknown variablesReference '%d'", int(request.variablesReference));
-			}
-			catch (const lua::LuaException& e) {
-				return dap::Error("Lua error: '%s'", e.what());
-			}
+				});
 		});
 
-	Session->registerHandler([&](const dap::SetVariableRequest& request)
-		-> dap::ResponseOrError<dap::SetVariableResponse> {
-			auto c = LuaExecutionPackagedTask<dap::SetVariableResponse>{ [this, request]() {
-				auto [s, lvl, sc, var] = DecodeStackFrame(static_cast<int>(request.variablesReference));
+	Session->registerHandler([&](const dap::SetVariableRequest& request, const Responder<dap::SetVariableResponse>& respond) {
+			RunPipelined(respond, std::format("Unknown variablesReference '{}'", int(request.variablesReference)), [this, request]() {
+				VariableHandle h = GetVariableHandle(static_cast<int>(request.variablesReference)); // copy, pinning more values may move it
+				auto& s = Dbg.GetState(h.State);
+				int lvl = h.Level;
 				lua::State L{ s.L };
 				lua::DebugInfo i{};
 				dap::SetVariableResponse response;
+				ForgetChildCounts(); // the new value gets evaluated, which may change any table
 
 				int t = L.GetTop();
+
+				if (h.Sc == Scope::None) {
+					PushPinnedValue(L, static_cast<int>(request.variablesReference));
+					if (!L.IsTable(t + 1)) {
+						L.SetTop(t);
+						throw std::invalid_argument{ "not a table" };
+					}
+					if (!PushChildKey(L, t + 1, request.name)) {
+						L.SetTop(t);
+						throw std::invalid_argument{ "variable not found" };
+					}
+					Dbg.EvaluateInContext(request.value, L, lvl);
+					L.SetTop(t + 3);
+					response.value = EnsureUTF8(Preview(L, -1));
+					response.type = L.TypeName(L.Type(-1));
+					L.SetTableRaw(t + 1);
+					L.SetTop(t);
+					return response;
+				}
+
 				if (!L.Debug_GetStack(lvl, i, lua::DebugInfoOptions::Source, true)) {
 					L.SetTop(t);
 					throw std::invalid_argument{ "invalid stack lvl" };
@@ -310,14 +291,15 @@ debug_lua::Adaptor::Adaptor(Debugger& d, const std::shared_ptr<dap::ReaderWriter
 					throw std::invalid_argument{ "c func" };
 				}
 
-				if (sc == Scope::Local) {
+				if (h.Sc == Scope::Local) {
 					int num = 1;
 					while (const char* n = L.Debug_GetLocal(lvl, num)) {
 						L.Pop(1);
 						if (n == request.name) {
 							Dbg.EvaluateInContext(request.value, L, lvl);
 							L.SetTop(t + 2);
-							response.value = EnsureUTF8(L.ToDebugString<Debugger::ToDebugString_Format>(-1));
+							response.value = EnsureUTF8(Preview(L, -1));
+							response.type = L.TypeName(L.Type(-1));
 							L.Debug_SetLocal(lvl, num);
 							L.SetTop(t);
 							return response;
@@ -326,14 +308,15 @@ debug_lua::Adaptor::Adaptor(Debugger& d, const std::shared_ptr<dap::ReaderWriter
 					}
 					L.SetTop(t);
 				}
-				else if (sc == Scope::Upvalue) {
+				else if (h.Sc == Scope::Upvalue) {
 					int num = 1;
 					while (const char* n = L.Debug_GetUpvalue(func, num)) {
 						L.Pop(1);
 						if (n == request.name) {
 							Dbg.EvaluateInContext(request.value, L, lvl);
 							L.SetTop(t + 2);
-							response.value = EnsureUTF8(L.ToDebugString<Debugger::ToDebugString_Format>(-1));
+							response.value = EnsureUTF8(Preview(L, -1));
+							response.type = L.TypeName(L.Type(-1));
 							L.Debug_SetUpvalue(func, num);
 							L.SetTop(t);
 							return response;
@@ -344,50 +327,37 @@ debug_lua::Adaptor::Adaptor(Debugger& d, const std::shared_ptr<dap::ReaderWriter
 				}
 
 				throw std::invalid_argument{ "variable not found" };
-				} };
-			Dbg.RunInSHoKThread(c);
-			try {
-				return c.Get();
-			}
-			catch (const std::invalid_argument&) {
-				return dap::Error("Unknown variablesReference '%d'", int(request.variablesReference));
-			}
-			catch (const lua::LuaException& e) {
-				return dap::Error("Lua error: '%s'", e.what());
-			}
+				});
 		});
 
-	Session->registerHandler([&](const dap::EvaluateRequest& request)
-		-> dap::ResponseOrError<dap::EvaluateResponse> {
-			auto c = LuaExecutionPackagedTask<dap::EvaluateResponse>{ [this, request]() {
-				lua::State L;
+	Session->registerHandler([&](const dap::EvaluateRequest& request, const Responder<dap::EvaluateResponse>& respond) {
+			RunPipelined(respond, std::format("Unknown frameId '{}'", int(request.frameId.value(0))), [this, request]() {
+				DebugState* s;
 				int lvl;
 				if (request.frameId.has_value()) {
-					auto [s, lvl2, _1, _2] = DecodeStackFrame(static_cast<int>(*request.frameId));
-					L = s.L;
+					auto [s2, lvl2] = DecodeStackFrame(static_cast<int>(*request.frameId));
+					s = &s2;
 					lvl = lvl2;
 				}
 				else {
 					lvl = 0;
-					L = Dbg.GetStates().back().L;
+					std::unique_lock lo{ Dbg.StatesMutex };
+					s = &Dbg.GetStates().Last();
 				}
+				lua::State L{ s->L };
 				
 				dap::EvaluateResponse r{};
 				int t = L.GetTop();
 
 				int n = Dbg.EvaluateInContext(request.expression, L, lvl);
+				ForgetChildCounts(); // the expression may have changed any table
 				r.result = Dbg.OutputString(L, n);
+				if (n == 1 && IsExpandable(L, -1))
+					r.variablesReference = PinValue(*s, L, -1, lvl);
 				
 				L.SetTop(t);
 				return r;
-				} };
-			Dbg.RunInSHoKThread(c);
-			try {
-				return c.Get();
-			}
-			catch (const lua::LuaException& e) {
-				return dap::Error("Lua error: '%s'", e.what());
-			}
+				});
 		});
 
 	Session->registerHandler([&](const dap::PauseRequest&) {
@@ -396,11 +366,14 @@ debug_lua::Adaptor::Adaptor(Debugger& d, const std::shared_ptr<dap::ReaderWriter
 			return dap::PauseResponse{};
 			} };
 		Dbg.RunInSHoKThread(c);
+		if (!c.WaitFor(Debugger::InterruptDelay))
+			Dbg.Interrupt();
 		return c.Get();
 		});
 
 	Session->registerHandler([&](const dap::ContinueRequest&) {
 		auto c = LuaExecutionPackagedTask<dap::ContinueResponse>{ [this]() {
+			ResetStop();
 			Dbg.Command(Debugger::Request::Resume);
 			return dap::ContinueResponse{};
 			} };
@@ -410,6 +383,7 @@ debug_lua::Adaptor::Adaptor(Debugger& d, const std::shared_ptr<dap::ReaderWriter
 
 	Session->registerHandler([&](const dap::NextRequest&) {
 		auto c = LuaExecutionPackagedTask<dap::NextResponse>{ [this]() {
+			ResetStop();
 			Dbg.Command(Debugger::Request::StepLine);
 			return dap::NextResponse{};
 			} };
@@ -419,6 +393,7 @@ debug_lua::Adaptor::Adaptor(Debugger& d, const std::shared_ptr<dap::ReaderWriter
 
 	Session->registerHandler([&](const dap::StepInRequest&) {
 		auto c = LuaExecutionPackagedTask<dap::StepInResponse>{ [this]() {
+			ResetStop();
 			Dbg.Command(Debugger::Request::StepIn);
 			return dap::StepInResponse{};
 			} };
@@ -428,6 +403,7 @@ debug_lua::Adaptor::Adaptor(Debugger& d, const std::shared_ptr<dap::ReaderWriter
 
 	Session->registerHandler([&](const dap::StepOutRequest&) {
 		auto c = LuaExecutionPackagedTask<dap::StepOutResponse>{ [this]() {
+			ResetStop();
 			Dbg.Command(Debugger::Request::StepOut);
 			return dap::StepOutResponse{};
 			} };
@@ -444,28 +420,29 @@ debug_lua::Adaptor::Adaptor(Debugger& d, const std::shared_ptr<dap::ReaderWriter
 				std::unique_lock l{ Dbg.StatesMutex };
 				dap::SetBreakpointsResponse r;
 				const dap::string& p = *request.source.path;
-				auto it = std::find_if(Dbg.Breakpoints.begin(), Dbg.Breakpoints.end(), [p](BreakpointFile f) {
-					return una::caseless::compare_utf8(p, f.SourceExternal) == 0; 
-					});
-				BreakpointFile* f;
-				if (it == Dbg.Breakpoints.end()) {
-					f = &Dbg.Breakpoints.emplace_back(p);
-				}
-				else {
-					f = &(*it);
-				}
+				BreakpointFile& f = Dbg.GetBreakpointFile(p);
 
-				f->Lines.clear();
+				f.Lines.clear();
 				if (request.breakpoints.has_value()) {
 					for (const auto& b : *request.breakpoints) {
-						f->Lines.push_back(static_cast<int>(b.line));
 						auto& br = r.breakpoints.emplace_back();
 						br.line = static_cast<int>(b.line);
+						Breakpoint bp{};
+						bp.Line = static_cast<int>(b.line);
+						bp.Condition = b.condition.value_or("");
+						bp.HitCondition = b.hitCondition.value_or("");
+						bp.LogMessage = b.logMessage.value_or("");
+						if (!BreakpointAction{}.SetHitCondition(bp.HitCondition)) {
+							br.verified = false;
+							br.message = "invalid hit condition, use [==|>|>=|<|<=|%] count";
+							continue;
+						}
+						f.Lines.push_back(std::move(bp));
 						br.verified = true;
 					}
 				}
 
-				Dbg.RebuildBreakpoints();
+				Dbg.RebuildBreakpoints(f);
 
 				return r;
 				} };
@@ -510,34 +487,43 @@ debug_lua::Adaptor::Adaptor(Debugger& d, const std::shared_ptr<dap::ReaderWriter
 		std::unique_lock lo{ Dbg.StatesMutex };
 		for (const auto& s : Dbg.GetStates()) {
 			for (const auto& src : s.SourcesLoaded) {
-				res.sources.push_back(MakeSource(src.External));
+				res.sources.push_back(MakeSource(src->External));
 			}
 		}
 
 		return res;
 		});
 
-	Session->registerHandler([&](const dap::SourceRequest& request)
-		-> dap::ResponseOrError<dap::SourceResponse> {
+	Session->registerHandler([&](const dap::SourceRequest& request, const Responder<dap::SourceResponse>& respond) {
 			if (request.source->sourceReference.has_value() && *request.source->sourceReference != 0) {
-				return dap::Error("Unknown source reference '%d'",
-					int(*request.source->sourceReference));
+				respond(dap::Error("Unknown source reference '%d'",
+					int(*request.source->sourceReference)));
+				return;
 			}
 
 			if (request.source.has_value() && request.source->path.has_value()) {
-				auto c = LuaExecutionPackagedTask<dap::SourceResponse>{ [this, request]() {
+				// scripts from archives can be served from the cache on this thread, as long as the archive did not change.
+				// reading them needs the engine's archive and decompression code, that only runs on the shok thread.
+				std::optional<int64_t> archtime{};
+				if (request.source->adapterData.has_value() && request.source->adapterData->is<dap::string>()) {
+					const auto& arch = request.source->adapterData->get<dap::string>();
+					archtime = SourceContentCache::ArchiveTime(arch);
+					if (archtime.has_value()) {
+						if (auto c = SourceContents.Get(arch, *request.source->path, *archtime)) {
+							dap::SourceResponse response;
+							response.content = *c;
+							respond(response);
+							return;
+						}
+					}
+				}
+
+				RunPipelined(respond, "could not locate source", [this, request, archtime]() {
 					std::unique_lock lo{ Dbg.StatesMutex };
 
 					auto read = [](BB::IStream* f) {
 						dap::SourceResponse response;
-
-						dap::string s{};
-						s.resize(f->GetSize());
-						f->Read(s.data(), s.size());
-						if (s.ends_with('\0'))
-							s.resize(s.size() - 2);
-
-						response.content = EnsureUTF8(s);
+						response.content = ReadSource(*f);
 						return response;
 					};
 
@@ -568,14 +554,22 @@ debug_lua::Adaptor::Adaptor(Debugger& d, const std::shared_ptr<dap::ReaderWriter
 						}
 						auto f = a->OpenFileStreamUnique(file.c_str(), BB::IStream::Flags::DefaultRead);
 
-						return read(f.get());
+						if (f == nullptr)
+							throw std::invalid_argument{ "" };
+
+						auto r = read(f.get());
+						if (archtime.has_value()) {
+							auto* e = a->SearchByHash(file.c_str());
+							SourceContents.Put(arch, *request.source->path, *archtime, e == nullptr ? 0 : e->Timestamp, r.content);
+						}
+						return r;
 					}
 
 
-					auto& stat = Dbg.GetStates();
 					std::string_view bbatoload{};
-					if (stat.size() > 1 && !stat[1].MapFile.empty()) {
-						bbatoload = stat[1].MapFile;
+					for (const auto& st : Dbg.GetStates()) {
+						if (!st.MapFile.empty())
+							bbatoload = st.MapFile;
 					}
 					EnsureBbaLoaded load{ bbatoload };
 
@@ -584,52 +578,142 @@ debug_lua::Adaptor::Adaptor(Debugger& d, const std::shared_ptr<dap::ReaderWriter
 						throw std::invalid_argument{""};
 
 					return read(&f);
-					} };
-				Dbg.RunInSHoKThread(c);
-				try {
-					return c.Get();
-				}
-				catch (const std::invalid_argument&) {
-					return dap::Error("could not locate source");
-				}
-				catch (const lua::LuaException& e) {
-					return dap::Error("Lua error: '%s'", e.what());
-				}
-				catch (const BB::CException& bbe) {
-					char msg[200]{};
-					bbe.CopyMessage(msg, 200 - 1);
-					return dap::Error("%s: %s", typeid(bbe).name(), msg);
-				}
+					});
+				return;
 			}
 
-			return dap::Error("Unknown source reference '%d'",
-				int(*request.source->sourceReference));
+			respond(dap::Error("Unknown source reference '%d'",
+				int(*request.source->sourceReference)));
 		});
 
 	Session->registerHandler(
-		[&](const dap::LaunchRequest&) {
+		[&](const LaunchRequest& r) {
 			IsAttached = false;
+			if (r.profilerInterval.has_value())
+				ProfilerInterval = static_cast<int>(*r.profilerInterval);
 			return dap::LaunchResponse();
 		});
 
 	Session->registerHandler(
-		[&](const dap::AttachRequest&) {
+		[&](const AttachRequest& r) {
 			IsAttached = true;
+			if (r.profilerInterval.has_value())
+				ProfilerInterval = static_cast<int>(*r.profilerInterval);
 			return dap::AttachResponse();
 		});
 
+	Session->registerHandler([&](const ProfilerRequest& request, const Responder<ProfilerResponse>& respond) {
+		auto status = [this](ProfilerResponse r) {
+			auto& p = Dbg.GetProfiler();
+			r.running = p.IsRunning();
+			r.samples = static_cast<dap::integer>(p.GetSampleCount());
+			r.dropped = static_cast<dap::integer>(p.GetDroppedCount());
+			return r;
+		};
+		if (request.command == "start" || request.command == "stop") {
+			// changes the hooks, so it has to run on the shok thread
+			RunPipelined(respond, "", [this, request, status]() {
+				if (request.command == "start")
+					Dbg.StartProfiler(request.interval.has_value() ? static_cast<int>(*request.interval) : ProfilerInterval);
+				else
+					Dbg.StopProfiler();
+				return status({});
+				});
+			return;
+		}
+		ProfilerResponse r{};
+		if (request.command == "reset") {
+			Dbg.GetProfiler().Reset();
+		}
+		else if (request.command == "export") {
+			auto f = request.format.value_or("collapsed");
+			if (f == "collapsed") {
+				r.data = Dbg.GetProfiler().Export(SamplingProfiler::Format::Collapsed);
+			}
+			else if (f == "speedscope") {
+				r.data = Dbg.GetProfiler().Export(SamplingProfiler::Format::Speedscope);
+			}
+			else {
+				respond(dap::Error("Unknown profiler format '%s'", f.c_str()));
+				return;
+			}
+		}
+		else {
+			respond(dap::Error("Unknown profiler command '%s'", request.command.c_str()));
+			return;
+		}
+		respond(status(std::move(r)));
+		});
+
+	Session->registerHandler(
+		[&](const CallProfileRequest& request, const Responder<CallProfileResponse>& respond) {
+			RunPipelined(respond, std::format("Unknown threadId '{}'", int(request.threadId.value(0))), [this, request]() {
+				if (request.command == "start")
+					Dbg.StartCallProfile();
+				else if (request.command == "stop")
+					Dbg.StopCallProfile();
+				else if (request.command != "reset" && request.command != "get")
+					throw std::runtime_error{ std::format("Unknown call profile command '{}'", request.command) };
+
+				CallProfileResponse r{};
+				r.running = Dbg.IsCallProfiling();
+				if (request.command != "reset" && request.command != "get")
+					return r;
+				std::unique_lock lo{ Dbg.StatesMutex };
+				const DebugState* only = nullptr;
+				if (request.threadId.has_value())
+					only = &Dbg.GetState(reinterpret_cast<lua_State*>(int(*request.threadId)));
+				for (const auto& s : Dbg.GetStates()) {
+					if (only != nullptr && only != &s)
+						continue;
+					if (request.command == "reset") {
+						if (s.Calls != nullptr)
+							s.Calls->Reset();
+						continue;
+					}
+					CallProfileState st{};
+					st.threadId = reinterpret_cast<int>(s.L);
+					st.name = s.Name;
+					if (s.Calls != nullptr) {
+						auto funcs = s.Calls->GetFunctions();
+						std::sort(funcs.begin(), funcs.end(), [](const CallProfile::Function* a, const CallProfile::Function* b) {
+							return a->Exclusive > b->Exclusive;
+							});
+						for (const auto* f : funcs) {
+							CallProfileFunction cf{};
+							cf.name = f->Name();
+							cf.calls = static_cast<dap::integer>(f->Calls);
+							cf.inclusive = std::chrono::duration<double, std::milli>(f->Inclusive).count();
+							cf.exclusive = std::chrono::duration<double, std::milli>(f->Exclusive).count();
+							st.functions.push_back(std::move(cf));
+						}
+					}
+					r.states.push_back(std::move(st));
+				}
+				return r;
+				});
+		});
+
 	Session->registerHandler([&](const dap::DisconnectRequest& request) {
 		{
 			std::lock_guard<std::mutex> lock(MutexTerminate);
 			TerminateDebugger = true;
-			Dbg.Handler = nullptr;
+			Dbg.SetHandler(nullptr);
+			Dbg.RunInSHoKThread(*new LuaExecutionCallbackTask{ [this, &d = Dbg, guard = Pipeline]() {
+				d.StopProfiler();
+				d.StopCallProfile();
+				// drop the pinned values, otherwise they stay in the registry until the next stop of another session
+				std::lock_guard<std::mutex> lock(guard->Mutex);
+				if (guard->Alive)
+					ResetStop();
+				} });
 			Dbg.Command(Debugger::Request::Resume);
 			if (!IsAttached) {
 				auto c = LuaExecutionPackagedTask<void>{ [this, request]() {
 					std::lock_guard<std::mutex> lock(Dbg.StatesMutex);
 					auto& s = Dbg.GetStates();
-					if (!s.empty())
-						Dbg.EvaluateInContext("Framework.ExitGame()", s[0].L, -1);
+					if (!s.Empty())
+						Dbg.EvaluateInContext("Framework.ExitGame()", s.First().L, -1);
 					} };
 				Dbg.RunInSHoKThread(c);
 				c.Get();
@@ -643,44 +727,374 @@ debug_lua::Adaptor::Adaptor(Debugger& d, const std::shared_ptr<dap::ReaderWriter
 		return dap::ConfigurationDoneResponse();
 		});
 
-	Dbg.Handler = this;
+	Dbg.SetHandler(this);
 	Session->bind(socket);
 }
 
-// encoded: lowest->highest bit: 2 state, 18 bits frame, 2 bits scope, 10 bits variable
+debug_lua::Adaptor::~Adaptor()
+{
+	std::lock_guard<std::mutex> lock(Pipeline->Mutex);
+	Pipeline->Alive = false;
+}
+
+template<class R, class W>
+dap::ResponseOrError<R> debug_lua::Adaptor::RunGuarded(const std::string& invalidArgument, W&& work)
+{
+	try {
+		return work();
+	}
+	catch (const std::invalid_argument&) {
+		return dap::Error("%s", invalidArgument.c_str());
+	}
+	catch (const lua::LuaException& e) {
+		return dap::Error("Lua error: '%s'", e.what());
+	}
+	catch (const BB::CException& bbe) {
+		char msg[200]{};
+		bbe.CopyMessage(msg, 200 - 1);
+		return dap::Error("%s: %s", typeid(bbe).name(), msg);
+	}
+	catch (const std::exception& e) {
+		return dap::Error("%s", e.what());
+	}
+}
+
+template<class R, class W>
+void debug_lua::Adaptor::RunPipelined(const Responder<R>& respond, std::string invalidArgument, W&& work)
+{
+	auto task = [invalidArgument = std::move(invalidArgument), work = std::forward<W>(work)]() mutable -> dap::ResponseOrError<R> {
+		return RunGuarded<R>(invalidArgument, work);
+	};
+	Dbg.RunInSHoKThread(*new LuaExecutionCallbackTask{ [respond, task = std::move(task), guard = Pipeline]() mutable {
+		// work uses the Adaptor, so it must not run after it is gone. ~Adaptor waits for a running one.
+		std::lock_guard<std::mutex> lock(guard->Mutex);
+		if (!guard->Alive)
+			return;
+		respond(task());
+		} });
+}
+
+dap::string debug_lua::Adaptor::ReadSource(BB::IStream& f)
+{
+	dap::string s{};
+	size_t left = f.GetSize();
+	s.reserve(left);
+	EnsureUTF8Stream conv{ s };
+	std::string chunk(std::min(left, SourceReadChunk), '\0');
+	while (left > 0) {
+		long n = f.Read(chunk.data(), static_cast<long>(std::min(left, chunk.size())));
+		if (n <= 0)
+			break;
+		conv.Append({ chunk.data(), static_cast<size_t>(n) });
+		left -= static_cast<size_t>(n);
+	}
+	conv.Finish();
+	if (s.ends_with('\0')) {
+		s.pop_back();
+		// and the character before it, which may have become more than one byte
+		while (!s.empty() && (static_cast<unsigned char>(s.back()) & 0xC0) == 0x80)
+			s.pop_back();
+		if (!s.empty())
+			s.pop_back();
+	}
+	return s;
+}
+
+std::string debug_lua::Adaptor::Preview(lua::State L, int idx)
+{
+	std::string r;
+	if (!L.IsTable(idx)) {
+		r = L.ToDebugString<Debugger::ToDebugString_Format>(idx);
+	}
+	else {
+		// only one level, nested tables are not expanded at all
+		idx = L.ToAbsoluteIndex(idx);
+		int t = L.GetTop();
+		r = "{";
+		bool first = true;
+		for (auto k : L.Pairs(idx)) {
+			if (r.size() > PreviewLength)
+				break;
+			if (!first)
+				r.append(", ");
+			first = false;
+			r.append(L.ToDebugString<Debugger::ToDebugString_Format>(-2));
+			r.append("=");
+			if (L.IsTable(-1))
+				r.append("{...}");
+			else
+				r.append(L.ToDebugString<Debugger::ToDebugString_Format>(-1));
+		}
+		L.SetTop(t);
+		r.append("}");
+	}
+	if (r.size() > PreviewLength) {
+		// convert first, so the cut can not split a multibyte sequence (and make the whole preview look like ansi)
+		EnsureUTF8InPlace(r);
+		size_t l = PreviewLength;
+		while (l > 0 && (static_cast<unsigned char>(r[l]) & 0xC0) == 0x80)
+			--l;
+		r.resize(l);
+		r.append("...");
+	}
+	return r;
+}
+
+bool debug_lua::Adaptor::IsExpandable(lua::State L, int idx)
+{
+	if (L.IsTable(idx))
+		return true;
+	if (!L.GetMetatable(idx))
+		return false;
+	L.Pop(1);
+	return true;
+}
+
+std::pair<int, int> debug_lua::Adaptor::CountChildren(lua::State L, int idx)
+{
+	idx = L.ToAbsoluteIndex(idx);
+	int indexed = 0, all = 0;
+	if (L.GetMetatable(idx)) {
+		L.Pop(1);
+		++all;
+	}
+	if (!L.IsTable(idx))
+		return { 0, all };
+	while (true) {
+		L.GetTableRaw(idx, indexed + 1);
+		bool nil = L.Type(-1) == lua::LType::Nil;
+		L.Pop(1);
+		if (nil)
+			break;
+		++indexed;
+	}
+	int t = L.GetTop();
+	for (auto k : L.Pairs(idx))
+		++all;
+	L.SetTop(t);
+	return { indexed, all - indexed };
+}
+
+std::pair<int, int> debug_lua::Adaptor::ChildCounts(lua::State L, int idx, int ref)
+{
+	// FillVariable counts every expandable child, so without this each listing walks all grandchildren again
+	auto& h = VariableHandles.at(ref - 1);
+	if (!h.Children)
+		h.Children = CountChildren(L, idx);
+	return *h.Children;
+}
+
+void debug_lua::Adaptor::ForgetChildCounts()
+{
+	for (auto& h : VariableHandles)
+		h.Children.reset();
+}
+
+void debug_lua::Adaptor::FillVariable(dap::Variable& v, const DebugState& s, lua::State L, int idx, int lvl)
+{
+	v.type = L.TypeName(L.Type(idx));
+	v.value = Preview(L, idx);
+	EnsureUTF8InPlace(v.value);
+	if (IsExpandable(L, idx)) {
+		int ref = PinValue(s, L, idx, lvl);
+		v.variablesReference = ref;
+		auto [indexed, named] = ChildCounts(L, idx, ref);
+		v.indexedVariables = indexed;
+		v.namedVariables = named;
+	}
+}
+
+void debug_lua::Adaptor::ListChildren(const DebugState& s, lua::State L, int idx, int ref, int lvl, const dap::VariablesRequest& request, dap::array<dap::Variable>& out)
+{
+	idx = L.ToAbsoluteIndex(idx);
+	int t = L.GetTop();
+	int start = static_cast<int>(request.start.value(0));
+	int count = static_cast<int>(request.count.value(0)); // 0 is all
+	auto [indexed, named] = ChildCounts(L, idx, ref);
+
+	if (request.filter.value("") == "indexed") {
+		// array part by raw index, so a window in a big array does not need to iterate over all the elements before it
+		int last = count > 0 ? std::min(indexed, start + count) : indexed;
+		for (int i = start + 1; i <= last; ++i) {
+			L.GetTableRaw(idx, i);
+			dap::Variable v;
+			v.name = std::format("[{}]", i);
+			FillVariable(v, s, L, -1, lvl);
+			L.Pop(1);
+			out.push_back(v);
+		}
+		return;
+	}
+
+	int skipped = 0;
+	auto add = [&](std::string name) {
+		if (skipped < start) {
+			++skipped;
+			return true;
+		}
+		if (count > 0 && out.size() >= static_cast<size_t>(count))
+			return false;
+		dap::Variable v;
+		v.name = std::move(name);
+		FillVariable(v, s, L, -1, lvl);
+		out.push_back(v);
+		return true;
+	};
+	if (L.GetMetatable(idx)) {
+		add(std::string{ MetatableName });
+		L.Pop(1);
+	}
+	if (L.IsTable(idx)) {
+		bool namedOnly = request.filter.value("") == "named";
+		for (auto k : L.Pairs(idx)) {
+			if (namedOnly && k == lua::LType::Number) {
+				double n = L.ToNumber(-2);
+				if (n >= 1 && n <= indexed && n == static_cast<int>(n))
+					continue;
+			}
+			if (!add(EnsureUTF8(L.ToDebugString<Debugger::ToDebugString_Format>(-2))))
+				break;
+		}
+	}
+	L.SetTop(t);
+}
+
+bool debug_lua::Adaptor::PushChildKey(lua::State L, int idx, std::string_view name)
+{
+	idx = L.ToAbsoluteIndex(idx);
+	// indexed children are named [i]
+	if (name.size() > 2 && name.front() == '[' && name.back() == ']') {
+		int i = 0;
+		auto num = name.substr(1, name.size() - 2);
+		auto [p, ec] = std::from_chars(num.data(), num.data() + num.size(), i);
+		if (ec == std::errc{} && p == num.data() + num.size()) {
+			L.Push(static_cast<double>(i));
+			return true;
+		}
+	}
+	int t = L.GetTop();
+	std::string buff{};
+	for (auto k : L.Pairs(idx)) {
+		auto ks = L.ToDebugString<Debugger::ToDebugString_Format>(-2);
+		if (EnsureUTF8View(ks, buff) == name) {
+			L.Pop(1); // value
+			return true;
+		}
+	}
+	L.SetTop(t);
+	return false;
+}
+
+// registry[&PinnedValuesKey] = { [variablesReference] = value }, keeps the values alive and reachable until the next resume
+static char PinnedValuesKey = 0;
+static void PushPinnedValuesTable(lua::State L)
+{
+	L.PushLightUserdata(&PinnedValuesKey);
+	L.GetTableRaw(L.REGISTRYINDEX);
+	if (L.IsTable(-1))
+		return;
+	L.Pop(1);
+	L.NewTable();
+	L.PushLightUserdata(&PinnedValuesKey);
+	L.PushValue(-2);
+	L.SetTableRaw(L.REGISTRYINDEX);
+}
+
+int debug_lua::Adaptor::ScopeReference(const DebugState& s, int lvl, Scope sc)
+{
+	VariableHandles.push_back(VariableHandle{ s.Handle, lvl, sc });
+	return static_cast<int>(VariableHandles.size());
+}
+
+int debug_lua::Adaptor::PinValue(const DebugState& s, lua::State L, int idx, int lvl)
+{
+	idx = L.ToAbsoluteIndex(idx);
+	const void* p = L.ToPointer(idx);
+	auto it = PinnedValues.find(p);
+	if (it != PinnedValues.end())
+		return it->second;
+	int ref = ScopeReference(s, lvl, Scope::None);
+	PushPinnedValuesTable(L);
+	L.PushValue(idx);
+	L.SetTableRaw(-2, ref);
+	L.Pop(1);
+	PinnedValues.emplace(p, ref);
+	return ref;
+}
+
+void debug_lua::Adaptor::PushPinnedValue(lua::State L, int ref)
+{
+	PushPinnedValuesTable(L);
+	L.GetTableRaw(-1, ref);
+	L.Remove(-2);
+}
+
+const debug_lua::Adaptor::VariableHandle& debug_lua::Adaptor::GetVariableHandle(int ref)
+{
+	if (ref <= 0 || static_cast<size_t>(ref) > VariableHandles.size())
+		throw std::invalid_argument{ "unknown variablesReference" };
+	return VariableHandles[ref - 1];
+}
+
+void debug_lua::Adaptor::ResetStop()
+{
+	{
+		std::lock_guard<std::mutex> lock(FrameCacheMutex);
+		FrameCache.clear();
+	}
+	VariableHandles.clear();
+	PinnedValues.clear();
+	std::unique_lock lo{ Dbg.StatesMutex };
+	for (const auto& s : Dbg.GetStates()) {
+		lua::State L{ s.L };
+		L.PushLightUserdata(&PinnedValuesKey);
+		L.Push();
+		L.SetTableRaw(L.REGISTRYINDEX);
+	}
+}
+
+// encoded: lowest->highest bit: 2 bits state slot, 12 bits state generation, 17 bits frame (sign bit unused)
 static constexpr int bitmask(int n) {
 	return (1 << n) - 1;
 }
-constexpr int state_bits = 2;
+constexpr int state_bits = debug_lua::DebugStateHandle::SlotBits;
 constexpr int state_mask = bitmask(state_bits);
-constexpr int frame_bits = 18;
-constexpr int frame_mask = bitmask(frame_bits) << state_bits;
-constexpr int scope_bits = 2;
-constexpr int scope_mask = bitmask(scope_bits) << frame_bits << state_bits;
-constexpr int var_bits = 10;
-constexpr int var_mask = bitmask(var_bits) << scope_bits << frame_bits << state_bits;
-static_assert(state_bits + frame_bits + scope_bits + var_bits == 32);
-std::optional<int> debug_lua::Adaptor::EncodeStackFrame(const DebugState& s, int lvl, Scope sc, int var)
+constexpr int gen_bits = debug_lua::DebugStateHandle::GenerationBits;
+constexpr int gen_mask = bitmask(gen_bits) << state_bits;
+constexpr int frame_bits = 17; // lua 5.0 allows at most 4096 nested calls (plus lost tail calls)
+constexpr int frame_mask = bitmask(frame_bits) << gen_bits << state_bits;
+static_assert(state_bits + gen_bits + frame_bits == 31);
+std::optional<int> debug_lua::Adaptor::EncodeStackFrame(const DebugState& s, int lvl)
 {
-	int si = Dbg.GetStateIndex(s);
-	if ((si & state_mask) != si)
-		return std::nullopt;
-	lvl = lvl << state_bits;
+	int si = s.Handle.Slot;
+	int gen = s.Handle.Generation << state_bits;
+	lvl = lvl << gen_bits << state_bits;
 	if ((lvl & frame_mask) != lvl)
 		return std::nullopt;
-	int sco = static_cast<int>(sc) << state_bits << frame_bits;
-	var = var << state_bits << frame_bits << scope_bits;
-	if ((var & var_mask) != var)
-		return std::nullopt;
-	return si | lvl | sco | var;
+	return si | gen | lvl;
 }
-std::tuple<debug_lua::DebugState&, int, debug_lua::Adaptor::Scope, int> debug_lua::Adaptor::DecodeStackFrame(int f)
+std::pair<debug_lua::DebugState&, int> debug_lua::Adaptor::DecodeStackFrame(int f)
 {
-	auto& s = Dbg.GetState(f & state_mask);
-	int lvl = (f & frame_mask) >> state_bits;
-	Scope sc = static_cast<Scope>((f & scope_mask) >> state_bits >> frame_bits);
-	int v = (f & var_mask) >> scope_bits >> state_bits >> frame_bits;
-	return { s, lvl, sc, v };
+	DebugStateHandle h{};
+	h.Slot = static_cast<uint16_t>(f & state_mask);
+	h.Generation = static_cast<uint16_t>((f & gen_mask) >> state_bits);
+	auto& s = Dbg.GetState(h); // throws if the state got closed in the meantime
+	int lvl = (f & frame_mask) >> state_bits >> gen_bits;
+	return { s, lvl };
+}
+
+std::optional<dap::StackTraceResponse> debug_lua::Adaptor::CachedStack::Get(int first, int levels) const
+{
+	if (Total < 0)
+		return std::nullopt;
+	int last = levels > 0 ? std::min(Total, first + levels) : Total;
+	if (static_cast<int>(Frames.size()) < last)
+		return std::nullopt;
+	dap::StackTraceResponse r;
+	r.totalFrames = Total;
+	if (first < last)
+		r.stackFrames.assign(Frames.begin() + first, Frames.begin() + last);
+	return r;
 }
 
 void debug_lua::Adaptor::WaitUntilDisconnected()
@@ -709,7 +1123,7 @@ void debug_lua::Adaptor::OnStateClosing(DebugState& s, bool lastState)
 			Session->send(ev);
 			std::lock_guard<std::mutex> lock(MutexTerminate);
 			TerminateDebugger = true;
-			Dbg.Handler = nullptr;
+			Dbg.SetHandlerLocked(nullptr); // OnStateClosing runs under StatesMutex
 		}
 		ConditionTerminate.notify_one();
 	}
@@ -719,7 +1133,7 @@ void debug_lua::Adaptor::OnStateClosing(DebugState& s, bool lastState)
 			for (const auto& st : Dbg.GetStates()) {
 				if (&st == &s)
 					continue;
-				if (std::find(st.SourcesLoaded.begin(), st.SourcesLoaded.end(), src) != st.SourcesLoaded.end()) {
+				if (std::find_if(st.SourcesLoaded.begin(), st.SourcesLoaded.end(), [&src](const auto& o) { return *o == *src; }) != st.SourcesLoaded.end()) {
 					found = true;
 					break;
 				}
@@ -727,7 +1141,7 @@ void debug_lua::Adaptor::OnStateClosing(DebugState& s, bool lastState)
 			if (!found) {
 				dap::LoadedSourceEvent le;
 				le.reason = "removed";
-				le.source.path = src.External;
+				le.source.path = src->External;
 				Session->send(le);
 			}
 		}
@@ -736,6 +1150,8 @@ void debug_lua::Adaptor::OnStateClosing(DebugState& s, bool lastState)
 
 void debug_lua::Adaptor::OnPaused(DebugState& s, Reason r, std::string_view exceptionText)
 {
+	// not every resume goes through a continue/step request (disconnect, OnShutdown), so the last stop may still be around
+	ResetStop();
 	dap::StoppedEvent ev;
 	switch (r) {
 	case Reason::Step:
@@ -780,12 +1196,13 @@ void debug_lua::Adaptor::OnSourceAdded(DebugState& s, std::string_view f)
 
 void debug_lua::Adaptor::OnShutdown()
 {
+	ResetStop();
 	{
 		dap::TerminatedEvent ev;
 		Session->send(ev);
 		std::lock_guard<std::mutex> lock(MutexTerminate);
 		TerminateDebugger = true;
-		Dbg.Handler = nullptr;
+		Dbg.SetHandler(nullptr);
 		Dbg.Command(Debugger::Request::Resume);
 	}
 	ConditionTerminate.notify_one();
@@ -1,15 +1,80 @@
 #pragma once
 
 #include <condition_variable>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <optional>
-#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <dap/io.h>
 #include <dap/session.h>
 #include <dap/protocol.h>
 
 #include "debugger.h"
+#include "sourcecache.h"
+
+namespace BB {
+	class IStream;
+}
+
+namespace debug_lua {
+	// launch/attach with our own launch.json attributes
+	struct LaunchRequest : dap::LaunchRequest {
+		dap::optional<dap::integer> profilerInterval;
+	};
+	struct AttachRequest : dap::AttachRequest {
+		dap::optional<dap::integer> profilerInterval;
+	};
+
+	struct ProfilerResponse : dap::Response {
+		dap::boolean running = false;
+		dap::integer samples = 0;
+		dap::integer dropped = 0;
+		dap::optional<dap::string> data; // export only
+	};
+	// custom request s5profiler, command is one of start, stop, reset, export
+	struct ProfilerRequest : dap::Request {
+		using Response = ProfilerResponse;
+		dap::string command;
+		dap::optional<dap::string> format; // export: collapsed (default) or speedscope
+		dap::optional<dap::integer> interval; // start: instructions between samples, default from launch.json
+	};
+	struct CallProfileFunction {
+		dap::string name;
+		dap::integer calls = 0;
+		dap::number inclusive = 0; // ms
+		dap::number exclusive = 0; // ms
+	};
+	struct CallProfileState {
+		dap::integer threadId = 0;
+		dap::string name;
+		dap::array<CallProfileFunction> functions; // most exclusive time first
+	};
+	struct CallProfileResponse : dap::Response {
+		dap::boolean running = false;
+		dap::array<CallProfileState> states; // get only
+	};
+	// custom request s5callprofile, command is one of start, stop, reset, get
+	struct CallProfileRequest : dap::Request {
+		using Response = CallProfileResponse;
+		dap::string command;
+		dap::optional<dap::integer> threadId; // reset/get: only this state, default all
+	};
+}
+
+namespace dap {
+	DAP_DECLARE_STRUCT_TYPEINFO(debug_lua::LaunchRequest);
+	DAP_DECLARE_STRUCT_TYPEINFO(debug_lua::AttachRequest);
+	DAP_DECLARE_STRUCT_TYPEINFO(debug_lua::ProfilerResponse);
+	DAP_DECLARE_STRUCT_TYPEINFO(debug_lua::ProfilerRequest);
+	DAP_DECLARE_STRUCT_TYPEINFO(debug_lua::CallProfileFunction);
+	DAP_DECLARE_STRUCT_TYPEINFO(debug_lua::CallProfileState);
+	DAP_DECLARE_STRUCT_TYPEINFO(debug_lua::CallProfileResponse);
+	DAP_DECLARE_STRUCT_TYPEINFO(debug_lua::CallProfileRequest);
+}
 
 namespace debug_lua {
 	class Adaptor : IDebugEventHandler {
@@ -17,18 +82,59 @@ namespace debug_lua {
 		Debugger& Dbg;
 		bool TerminateDebugger = false;
 		bool IsAttached = false, UnderstandsType = false;
+		int ProfilerInterval = SamplingProfiler::DefaultInterval;
 		std::condition_variable ConditionTerminate;
 		std::mutex MutexTerminate;
+		// pipelined requests may run after the client disconnected and the Adaptor is gone, they must not do anything then.
+		// held while one runs.
+		struct PipelineGuard {
+			std::mutex Mutex;
+			bool Alive = true;
+		};
+		std::shared_ptr<PipelineGuard> Pipeline = std::make_shared<PipelineGuard>();
 
 		enum class Scope : int {
 			None, Local, Upvalue,
 		};
 
+		// what a variablesReference points to, either a scope of a stack frame or a pinned value (Scope::None).
+		// only valid until the next resume, only used from the shok thread.
+		struct VariableHandle {
+			DebugStateHandle State;
+			int Level = 0;
+			Scope Sc = Scope::None;
+			std::optional<std::pair<int, int>> Children; // CountChildren of a pinned value, see ChildCounts
+		};
+		std::vector<VariableHandle> VariableHandles; // variablesReference - 1
+		std::unordered_map<const void*, int> PinnedValues; // lua_topointer -> variablesReference
+
+		// stack frames of each thread at the current stop, filled up as far as they got requested.
+		// only valid until the next resume.
+		struct CachedStack {
+			int Total = -1;
+			std::vector<dap::StackFrame> Frames; // starting at level 0
+
+			// nullopt if not enough frames are cached
+			std::optional<dap::StackTraceResponse> Get(int first, int levels) const;
+		};
+		std::mutex FrameCacheMutex;
+		std::unordered_map<int, CachedStack> FrameCache; // threadId -> stack
+
+		SourceContentCache SourceContents;
+
+		static constexpr size_t PreviewLength = 100;
+		static constexpr size_t SourceReadChunk = 64 * 1024;
+		static constexpr std::string_view MetatableName = "[metatable]";
+
+		template<class R>
+		using Responder = std::function<void(dap::ResponseOrError<R>)>;
+
 	public:
 		Adaptor(Debugger& d, const std::shared_ptr<dap::ReaderWriter>& socket);
+		~Adaptor();
 
-		std::optional<int> EncodeStackFrame(const DebugState& s, int lvl, Scope sc, int var);
-		std::tuple<DebugState&, int, Scope, int> DecodeStackFrame(int f);
+		std::optional<int> EncodeStackFrame(const DebugState& s, int lvl);
+		std::pair<DebugState&, int> DecodeStackFrame(int f);
 		void WaitUntilDisconnected();
 
 		virtual void OnStateOpened(DebugState& s) override;
@@ -39,5 +145,36 @@ namespace debug_lua {
 		virtual void OnShutdown() override;
 	private:
 		dap::Source MakeSource(std::string_view s) const;
+		// one line, length capped value for the variables view
+		std::string Preview(lua::State L, int idx);
+		// tables and everything with a metatable
+		bool IsExpandable(lua::State L, int idx);
+		// {array part (1..n), everything else (including the metatable)}
+		std::pair<int, int> CountChildren(lua::State L, int idx);
+		// CountChildren of the pinned value ref (at idx), cached until the next resume or a change by the client
+		std::pair<int, int> ChildCounts(lua::State L, int idx, int ref);
+		void ForgetChildCounts();
+		// type, preview, and for expandable values a reference and the child counts
+		void FillVariable(dap::Variable& v, const DebugState& s, lua::State L, int idx, int lvl);
+		// the metatable and entries of the value at idx (pinned as ref), paged and filtered as requested
+		void ListChildren(const DebugState& s, lua::State L, int idx, int ref, int lvl, const dap::VariablesRequest& request, dap::array<dap::Variable>& out);
+		// pushes the key of the child named name (as listed by ListChildren) of the table at idx
+		bool PushChildKey(lua::State L, int idx, std::string_view name);
+
+		int ScopeReference(const DebugState& s, int lvl, Scope sc);
+		int PinValue(const DebugState& s, lua::State L, int idx, int lvl);
+		void PushPinnedValue(lua::State L, int ref);
+		const VariableHandle& GetVariableHandle(int ref);
+		// call before resuming, all references and cached frames of the last stop become invalid
+		void ResetStop();
+		// runs work in the shok thread without blocking the dap thread and responds once it is done.
+		// this way the client can send more requests in the meantime, that all get executed in the same CheckRun.
+		template<class R, class W>
+		void RunPipelined(const Responder<R>& respond, std::string invalidArgument, W&& work);
+		// runs work, exceptions become error responses
+		template<class R, class W>
+		static dap::ResponseOrError<R> RunGuarded(const std::string& invalidArgument, W&& work);
+		// file contents to utf8, without the trailing \0. converted while reading, so big scripts are not held twice.
+		static dap::string ReadSource(BB::IStream& f);
 	};
 }
\ No newline at end of file
@@ -0,0 +1,245 @@
+// no pch, this has to build off windows for the tests
+#include "codepage.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define DEBUG_LUA_SSE2
+#endif
+
+debug_lua::SingleByteCodePage::SingleByteCodePage(const std::array<char32_t, 256>& table)
+{
+	for (size_t b = 0; b < table.size(); ++b) {
+		char32_t c = table[b];
+		auto& s = ToUTF8Table[b];
+		if (c == Invalid || c > 0xFFFF)
+			c = Invalid;
+		else
+			FromUnicode.emplace(c, static_cast<char>(b));
+		if (c < 0x80) {
+			s.Length = 1;
+			s.Bytes[0] = static_cast<char>(c);
+		}
+		else if (c < 0x800) {
+			s.Length = 2;
+			s.Bytes[0] = static_cast<char>(0xC0 | (c >> 6));
+			s.Bytes[1] = static_cast<char>(0x80 | (c & 0x3F));
+		}
+		else {
+			s.Length = 3;
+			s.Bytes[0] = static_cast<char>(0xE0 | (c >> 12));
+			s.Bytes[1] = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+			s.Bytes[2] = static_cast<char>(0x80 | (c & 0x3F));
+		}
+	}
+}
+
+void debug_lua::SingleByteCodePage::AppendUTF8(std::string_view ansi, std::string& out) const
+{
+	size_t len = 0;
+	for (char c : ansi)
+		len += ToUTF8Table[static_cast<unsigned char>(c)].Length;
+	size_t o = out.size();
+	out.resize(o + len);
+	char* p = out.data() + o;
+	for (char c : ansi) {
+		const auto& s = ToUTF8Table[static_cast<unsigned char>(c)];
+		p[0] = s.Bytes[0];
+		if (s.Length > 1) {
+			p[1] = s.Bytes[1];
+			if (s.Length > 2)
+				p[2] = s.Bytes[2];
+		}
+		p += s.Length;
+	}
+}
+
+std::string debug_lua::SingleByteCodePage::ToUTF8(std::string_view ansi) const
+{
+	std::string r{};
+	AppendUTF8(ansi, r);
+	return r;
+}
+
+std::string debug_lua::SingleByteCodePage::FromUTF8(std::string_view utf8) const
+{
+	std::string r{};
+	r.reserve(utf8.size());
+	size_t i = 0;
+	while (i < utf8.size()) {
+		unsigned char b = static_cast<unsigned char>(utf8[i]);
+		if (b < 0x80) {
+			r.push_back(static_cast<char>(b));
+			++i;
+			continue;
+		}
+		size_t len = b >= 0xF0 ? 4 : b >= 0xE0 ? 3 : b >= 0xC0 ? 2 : 0;
+		if (len == 0 || i + len > utf8.size()) {
+			r.push_back(Unmappable);
+			++i;
+			continue;
+		}
+		char32_t c = b & (0xFF >> (len + 1));
+		bool valid = true;
+		for (size_t j = 1; j < len; ++j) {
+			unsigned char n = static_cast<unsigned char>(utf8[i + j]);
+			if ((n & 0xC0) != 0x80) {
+				valid = false;
+				break;
+			}
+			c = (c << 6) | (n & 0x3F);
+		}
+		if (!valid) {
+			r.push_back(Unmappable);
+			++i;
+			continue;
+		}
+		auto it = FromUnicode.find(c);
+		r.push_back(it == FromUnicode.end() ? Unmappable : it->second);
+		i += len;
+	}
+	return r;
+}
+
+bool debug_lua::IsASCII(std::string_view data)
+{
+	const char* p = data.data();
+	const char* end = p + data.size();
+#ifdef DEBUG_LUA_SSE2
+	// any byte with the high bit set shows up in the movemask
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		if (_mm_movemask_epi8(v) != 0)
+			return false;
+		p += 16;
+	}
+#endif
+	while (end - p >= 8) {
+		uint64_t v;
+		std::memcpy(&v, p, sizeof(v));
+		if (v & 0x8080808080808080ull)
+			return false;
+		p += 8;
+	}
+	for (; p < end; ++p) {
+		if (static_cast<unsigned char>(*p) & 0x80)
+			return false;
+	}
+	return true;
+}
+
+size_t debug_lua::ValidUTF8Length(std::string_view data, bool& incomplete)
+{
+	incomplete = false;
+	size_t i = 0;
+	while (i < data.size()) {
+		// ascii runs 8 bytes at a time
+		if (data.size() - i >= 8) {
+			uint64_t v;
+			std::memcpy(&v, data.data() + i, sizeof(v));
+			if ((v & 0x8080808080808080ull) == 0) {
+				i += 8;
+				continue;
+			}
+		}
+		unsigned char b = static_cast<unsigned char>(data[i]);
+		if (b < 0x80) {
+			++i;
+			continue;
+		}
+		// the allowed range of the second byte excludes overlong forms, surrogates and everything above U+10FFFF
+		size_t len;
+		unsigned char lo = 0x80, hi = 0xBF;
+		if (b >= 0xC2 && b <= 0xDF) {
+			len = 2;
+		}
+		else if (b >= 0xE0 && b <= 0xEF) {
+			len = 3;
+			if (b == 0xE0)
+				lo = 0xA0;
+			else if (b == 0xED)
+				hi = 0x9F;
+		}
+		else if (b >= 0xF0 && b <= 0xF4) {
+			len = 4;
+			if (b == 0xF0)
+				lo = 0x90;
+			else if (b == 0xF4)
+				hi = 0x8F;
+		}
+		else {
+			return i;
+		}
+		for (size_t j = 1; j < len; ++j) {
+			if (i + j >= data.size()) {
+				incomplete = true;
+				return i;
+			}
+			unsigned char n = static_cast<unsigned char>(data[i + j]);
+			if (n < lo || n > hi)
+				return i;
+			lo = 0x80;
+			hi = 0xBF;
+		}
+		i += len;
+	}
+	return i;
+}
+
+debug_lua::UTF8ChunkDecoder::UTF8ChunkDecoder(const SingleByteCodePage& cp, std::string& out)
+	: CodePage(cp), Out(out)
+{
+}
+
+void debug_lua::UTF8ChunkDecoder::Append(std::string_view chunk)
+{
+	if (CarryLength > 0) {
+		// try to complete the carried sequence with the first bytes of this chunk
+		char seq[4];
+		std::memcpy(seq, Carry, CarryLength);
+		size_t take = std::min(sizeof(seq) - CarryLength, chunk.size());
+		std::memcpy(seq + CarryLength, chunk.data(), take);
+		unsigned char b = static_cast<unsigned char>(seq[0]);
+		size_t len = b >= 0xF0 ? 4 : b >= 0xE0 ? 3 : 2;
+		bool incomplete;
+		size_t valid = ValidUTF8Length({ seq, CarryLength + take }, incomplete);
+		if (valid >= len) {
+			Out.append(seq, len);
+			chunk.remove_prefix(len - CarryLength);
+			CarryLength = 0;
+		}
+		else if (incomplete) {
+			// still not enough, a tiny chunk
+			std::memcpy(Carry, seq, CarryLength + take);
+			CarryLength += take;
+			return;
+		}
+		else {
+			CodePage.AppendUTF8({ Carry, CarryLength }, Out);
+			CarryLength = 0;
+		}
+	}
+
+	bool incomplete;
+	size_t valid = ValidUTF8Length(chunk, incomplete);
+	if (valid == chunk.size()) {
+		Out.append(chunk);
+	}
+	else if (incomplete) {
+		Out.append(chunk.substr(0, valid));
+		CarryLength = chunk.size() - valid;
+		std::memcpy(Carry, chunk.data() + valid, CarryLength);
+	}
+	else {
+		CodePage.AppendUTF8(chunk, Out);
+	}
+}
+
+void debug_lua::UTF8ChunkDecoder::Finish()
+{
+	if (CarryLength > 0)
+		CodePage.AppendUTF8({ Carry, CarryLength }, Out);
+	CarryLength = 0;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <array>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace debug_lua {
+	// single byte code page <-> utf8 without going through utf16.
+	// the tables get built once, the conversions themselves do not need any windows api.
+	class SingleByteCodePage {
+		struct Sequence {
+			unsigned char Length = 0;
+			char Bytes[3] = {}; // code pages only map into the BMP, so 3 bytes are enough
+		};
+		std::array<Sequence, 256> ToUTF8Table{};
+		std::unordered_map<char32_t, char> FromUnicode;
+
+	public:
+		static constexpr char32_t Invalid = 0xFFFD;
+		static constexpr char Unmappable = '?';
+
+		// table[b] is the unicode code point of byte b, Invalid if b is undefined
+		explicit SingleByteCodePage(const std::array<char32_t, 256>& table);
+
+		// appends directly to out, no temporary buffers
+		void AppendUTF8(std::string_view ansi, std::string& out) const;
+		std::string ToUTF8(std::string_view ansi) const;
+		// characters that do not exist in the code page (and invalid utf8) become Unmappable
+		std::string FromUTF8(std::string_view utf8) const;
+
+		// the code page shok uses (CP_ACP), nullptr if that is not a single byte code page. in winhelpers.cpp.
+		static const SingleByteCodePage* ANSI();
+	};
+
+	// true if data only contains 7 bit characters, checks 16 bytes at a time
+	bool IsASCII(std::string_view data);
+	// length of the valid utf8 at the start of data.
+	// incomplete is set if the rest is the start of a valid sequence that got cut off by the end of data.
+	size_t ValidUTF8Length(std::string_view data, bool& incomplete);
+
+	// EnsureUTF8 for data that arrives in chunks (file reads), appends to out.
+	// chunks that are valid utf8 are kept, all others get converted from the code page.
+	// a sequence split between two chunks is carried over, so it does not make either chunk look invalid.
+	class UTF8ChunkDecoder {
+		const SingleByteCodePage& CodePage;
+		std::string& Out;
+		char Carry[3] = {};
+		size_t CarryLength = 0;
+
+	public:
+		UTF8ChunkDecoder(const SingleByteCodePage& cp, std::string& out);
+
+		void Append(std::string_view chunk);
+		// a sequence that is still cut off at the end is not utf8
+		void Finish();
+	};
+}
@@ -1,7 +1,7 @@
 #include "pch.h"
 #include "debugger.h"
-#include <regex>
-#include <thread>
+#include <cctype>
+#include <charconv>
 #include <filesystem>
 #include <uni_algo/case.h>
 #include "Hooks.h"
@@ -9,33 +9,124 @@
 #include "winhelpers.h"
 #include "utility.h"
 
-bool debug_lua::operator==(DebugState d, lua_State* l)
+void debug_lua::SourceRegistry::Add(Source* s)
 {
-    return d.L == l;
+    ByInternal.emplace(s->Internal, s);
+    std::string k = ExternalKey(s->External);
+    ByExternalFile.emplace(ExternalKey(Debugger::SourceToFileAndArchive(s->External).first), s);
+    ByExternal.emplace(std::move(k), s);
+}
+template<class M, class K>
+static void RemoveFromMultimap(M& m, const K& k, const debug_lua::Source* s)
+{
+    auto [it, end] = m.equal_range(k);
+    while (it != end) {
+        if (it->second == s)
+            it = m.erase(it);
+        else
+            ++it;
+    }
+}
+void debug_lua::SourceRegistry::Remove(const Source* s)
+{
+    RemoveFromMultimap(ByInternal, std::string_view{ s->Internal }, s);
+    RemoveFromMultimap(ByExternal, ExternalKey(s->External), s);
+    RemoveFromMultimap(ByExternalFile, ExternalKey(Debugger::SourceToFileAndArchive(s->External).first), s);
+}
+debug_lua::Source* debug_lua::SourceRegistry::FindInternal(std::string_view i) const
+{
+    auto it = ByInternal.find(i);
+    return it == ByInternal.end() ? nullptr : it->second;
+}
+debug_lua::Source* debug_lua::SourceRegistry::FindExternal(std::string_view e, bool fileOnly) const
+{
+    const auto& m = fileOnly ? ByExternalFile : ByExternal;
+    auto it = m.find(ExternalKey(e));
+    return it == m.end() ? nullptr : it->second;
+}
+std::vector<debug_lua::Source*> debug_lua::SourceRegistry::FindAllExternal(std::string_view e, bool fileOnly) const
+{
+    const auto& m = fileOnly ? ByExternalFile : ByExternal;
+    auto [it, end] = m.equal_range(ExternalKey(e));
+    std::vector<Source*> r{};
+    for (; it != end; ++it)
+        r.push_back(it->second);
+    return r;
+}
+std::string debug_lua::SourceRegistry::ExternalKey(std::string_view e)
+{
+    // same folding una::caseless::compare_utf8 uses
+    return una::cases::to_casefold_utf8(e);
 }
 
-debug_lua::DebugState& debug_lua::Debugger::GetState(lua_State* l)
+debug_lua::DebugState& debug_lua::DebugStateTable::Add(lua_State* l, const char* name)
 {
-    std::unique_lock lo{ StatesMutex };
-    for (DebugState& r : States) {
-        if (r.L == l)
-            return r;
+    for (size_t i = 0; i < Slots.size(); ++i) {
+        auto& sl = Slots[i];
+        if (sl.State.has_value())
+            continue;
+        auto& r = sl.State.emplace(l, name);
+        r.Handle.Slot = static_cast<uint16_t>(i);
+        r.Handle.Generation = sl.Generation.load(std::memory_order_relaxed);
+        sl.L.store(l, std::memory_order_release);
+        return r;
     }
-    throw std::invalid_argument{ "state does not exist" };
+    throw std::out_of_range{ "too many lua states" };
 }
-debug_lua::DebugState& debug_lua::Debugger::GetState(int i)
+void debug_lua::DebugStateTable::Remove(DebugState& s)
 {
-    std::unique_lock lo{ StatesMutex };
-    return States.at(i);
+    auto& sl = Slots.at(s.Handle.Slot);
+    if (!sl.State.has_value() || &*sl.State != &s)
+        throw std::invalid_argument{ "state does not exist" };
+    sl.L.store(nullptr, std::memory_order_release);
+    sl.Generation.store((sl.Generation.load(std::memory_order_relaxed) + 1) & ((1 << DebugStateHandle::GenerationBits) - 1), std::memory_order_relaxed);
+    sl.State.reset();
 }
-int debug_lua::Debugger::GetStateIndex(const DebugState& s)
+debug_lua::DebugState* debug_lua::DebugStateTable::Get(DebugStateHandle h)
 {
-    std::unique_lock lo{ StatesMutex };
-    for (size_t i = 0; i < States.size(); ++i) {
-        if (&s == &States[i])
-            return static_cast<int>(i);
+    auto& sl = Slots[h.Slot];
+    if (sl.L.load(std::memory_order_acquire) == nullptr || sl.Generation.load(std::memory_order_relaxed) != h.Generation)
+        return nullptr;
+    return &*sl.State;
+}
+debug_lua::DebugState* debug_lua::DebugStateTable::Find(lua_State* l)
+{
+    for (auto& sl : Slots) {
+        if (sl.L.load(std::memory_order_acquire) == l)
+            return &*sl.State;
     }
-    throw std::invalid_argument{ "state does not exist" };
+    return nullptr;
+}
+size_t debug_lua::DebugStateTable::Count() const
+{
+    return std::count_if(Slots.begin(), Slots.end(), [](const Slot& sl) { return sl.State.has_value(); });
+}
+debug_lua::DebugState& debug_lua::DebugStateTable::First()
+{
+    return *begin();
+}
+debug_lua::DebugState& debug_lua::DebugStateTable::Last()
+{
+    for (auto it = Slots.rbegin(); it != Slots.rend(); ++it) {
+        if (it->State.has_value())
+            return *it->State;
+    }
+    throw std::out_of_range{ "no lua state" };
+}
+
+debug_lua::DebugState& debug_lua::Debugger::GetState(lua_State* l)
+{
+    auto* s = States.Find(l);
+    if (s == nullptr)
+        throw std::invalid_argument{ "state does not exist" };
+    return *s;
+}
+debug_lua::DebugState& debug_lua::Debugger::GetState(DebugStateHandle h)
+{
+    auto* s = States.Get(h);
+    if (s == nullptr)
+        throw std::invalid_argument{ "state does not exist" };
+    return *s;
 }
 
 void debug_lua::Debugger::OnStateAdded(lua_State* l, const char* name, lua::CFunction shutdown)
@@ -43,12 +134,16 @@ void debug_lua::Debugger::OnStateAdded(lua_State* l, const char* name, lua::CFun
     DebugState* s;
     {
         std::unique_lock lo{ StatesMutex };
+        SHoKThread = std::this_thread::get_id();
         Hooks::InstallHook();
         Hooks::RunCallback = std::bind(&Debugger::RunCallback, this);
         if (name == nullptr)
-            name = States.empty() ? "Main Menu" : "Ingame";
-        bool isingame = !States.empty();
-        s = &States.emplace_back(l, name);
+            name = States.Empty() ? "Main Menu" : "Ingame";
+        bool isingame = !States.Empty();
+        s = &States.Add(l, name);
+        if (CallProfiling)
+            s->Calls = std::make_unique<CallProfile>();
+        SetHookContext(*s, true);
         InitializeLua(lua::State{ s->L }, !isingame, shutdown);
         if (isingame) {
             Framework::CMain* ma = *Framework::CMain::GlobalObj;
@@ -85,12 +180,16 @@ void debug_lua::Debugger::OnStateAdded(lua_State* l, const char* name, lua::CFun
 void debug_lua::Debugger::OnStateClosed(lua_State* l)
 {
     std::unique_lock lo{ StatesMutex };
-    auto i = std::find(States.begin(), States.end(), l);
-    if (i == States.end())
+    auto* s = States.Find(l);
+    if (s == nullptr)
         throw std::invalid_argument{ "trying to close a state that does not exist" };
     if (Handler)
-        Handler->OnStateClosing(*i, States.size() == 1);
-    States.erase(i);
+        Handler->OnStateClosing(*s, States.Count() == 1);
+    for (const auto& src : s->SourcesLoaded)
+        Sources.Remove(src.get());
+    BreakpointSourceCache.clear(); // lua strings of this state are gone, their addresses might get reused
+    SetHookContext(*s, false);
+    States.Remove(*s);
 }
 
 void debug_lua::Debugger::OnBreak(lua_State* l)
@@ -101,14 +200,9 @@ void debug_lua::Debugger::OnBreak(lua_State* l)
         return;
     if (Evaluating)
         return;
-    DebugState* s = nullptr;
-    {
-        std::unique_lock lo{ StatesMutex };
-        auto i = std::find(States.begin(), States.end(), l);
-        if (i == States.end())
-            throw std::invalid_argument{ "trying to break a state that does not exist" };
-        s = &*i;
-    }
+    DebugState* s = States.Find(l);
+    if (s == nullptr)
+        throw std::invalid_argument{ "trying to break a state that does not exist" };
     /*Command(Request::StepOut);
     TranslateRequest(lua::State{ l });
     Re = Request::BreakpointAtLevel;*/
@@ -131,10 +225,10 @@ void debug_lua::Debugger::OnBreak(lua_State* l)
 void debug_lua::Debugger::OnSourceLoaded(lua_State* L, const char* filename)
 {
     std::unique_lock lo{ StatesMutex };
-    auto i = std::find(States.begin(), States.end(), L);
-    if (i == States.end())
+    auto* s = States.Find(L);
+    if (s == nullptr)
         throw std::invalid_argument{ "trying to add a source to a state that does not exist" };
-    DoAddSource(*i, filename);
+    DoAddSource(*s, filename);
 }
 
 void debug_lua::Debugger::OnShutdown(std::function<void()> cb)
@@ -154,12 +248,91 @@ void debug_lua::Debugger::OnShutdown(std::function<void()> cb)
     RunInSHoKThread(*c);
 }
 
+void debug_lua::LuaExecutionTaskQueue::Push(LuaExecutionTask& t)
+{
+    LuaExecutionTask* h = Head.load(std::memory_order_relaxed);
+    do {
+        t.Next = h;
+    } while (!Head.compare_exchange_weak(h, &t, std::memory_order_release, std::memory_order_relaxed));
+}
+debug_lua::LuaExecutionTask* debug_lua::LuaExecutionTaskQueue::TakeAll()
+{
+    LuaExecutionTask* l = Head.exchange(nullptr, std::memory_order_acquire);
+    // pushed as a stack, reverse to get them in order
+    LuaExecutionTask* r = nullptr;
+    while (l != nullptr) {
+        LuaExecutionTask* n = l->Next;
+        l->Next = r;
+        r = l;
+        l = n;
+    }
+    return r;
+}
+
 void debug_lua::Debugger::RunInSHoKThread(LuaExecutionTask& t)
 {
-    std::unique_lock l{ DataMutex };
-    Tasks.push_back(&t);
-    HasTasks = true;
-    Hooks::SendCheckRun();
+    Tasks.Push(t);
+    if (!CheckRunPosted.exchange(true))
+        Hooks::SendCheckRun();
+    Wake.Set();
+}
+
+void debug_lua::Debugger::SetHandler(IDebugEventHandler* h)
+{
+    std::unique_lock lo{ StatesMutex };
+    Handler = h;
+    ScheduleCheckHooked();
+}
+void debug_lua::Debugger::SetHandlerLocked(IDebugEventHandler* h)
+{
+    Handler = h;
+    CheckHooked();
+}
+
+void debug_lua::Debugger::Interrupt()
+{
+    std::unique_lock lo{ StatesMutex };
+    if (Tasks.Empty())
+        return;
+    InterruptRequested = true;
+    // the shok thread is busy in lua, so only set a count hook (lua_sethook may be called asynchronously).
+    // the hook then runs the tasks and recomputes the hook mode on the shok thread.
+    for (auto& s : States)
+        lua::State{ s.L }.Debug_SetHook<Hook>(lua::HookEvent::Count, 1);
+}
+
+void debug_lua::Debugger::StartProfiler(int interval)
+{
+    std::unique_lock lo{ StatesMutex };
+    Profiler.Start(interval);
+    CheckHooked();
+}
+
+void debug_lua::Debugger::StopProfiler()
+{
+    std::unique_lock lo{ StatesMutex };
+    Profiler.Stop();
+    CheckHooked();
+}
+
+void debug_lua::Debugger::StartCallProfile()
+{
+    std::unique_lock lo{ StatesMutex };
+    for (auto& s : States) {
+        if (s.Calls == nullptr)
+            s.Calls = std::make_unique<CallProfile>();
+        else
+            s.Calls->ClearStack(); // missed the events while stopped
+    }
+    CallProfiling = true;
+    CheckHooked();
+}
+
+void debug_lua::Debugger::StopCallProfile()
+{
+    std::unique_lock lo{ StatesMutex };
+    CallProfiling = false;
+    CheckHooked();
 }
 
 void debug_lua::Debugger::Command(Request r)
@@ -168,23 +341,187 @@ void debug_lua::Debugger::Command(Request r)
     Re = r;
     if (r == Request::Pause)
         LineFix = true;
-    CheckHooked();
+    ScheduleCheckHooked();
+    Wake.Set();
+}
+
+void debug_lua::BreakpointLines::Set(int line)
+{
+    if (line < 0)
+        return;
+    if (static_cast<size_t>(line) >= Lines.size())
+        Lines.resize(line + 1, false);
+    Lines[line] = true;
+}
+void debug_lua::BreakpointLines::Set(int line, BreakpointAction&& a)
+{
+    if (line < 0)
+        return;
+    Set(line);
+    if (a.NeedsAction())
+        Actions.insert_or_assign(line, std::move(a));
 }
 
-void debug_lua::Debugger::RebuildBreakpoints()
+bool debug_lua::BreakpointAction::SetHitCondition(std::string_view s)
 {
-    BreakpointLookup.clear();
-    for (auto& b : Breakpoints) {
-        auto* s = SearchExternalUnsafe(b.SourceExternal, true);
-        if (s == nullptr)
+    auto trim = [](std::string_view& s) {
+        while (!s.empty() && std::isspace(static_cast<unsigned char>(s.front())))
+            s.remove_prefix(1);
+        while (!s.empty() && std::isspace(static_cast<unsigned char>(s.back())))
+            s.remove_suffix(1);
+    };
+    trim(s);
+    HitOp = HitOperator::None;
+    HitCount = 0;
+    if (s.empty())
+        return true;
+    constexpr std::pair<std::string_view, HitOperator> ops[]{
+        { "==", HitOperator::Equal },
+        { ">=", HitOperator::GreaterEqual },
+        { "<=", HitOperator::LessEqual },
+        { ">", HitOperator::Greater },
+        { "<", HitOperator::Less },
+        { "%", HitOperator::Modulo },
+        { "=", HitOperator::Equal },
+    };
+    HitOperator op = HitOperator::Equal;
+    for (const auto& [str, o] : ops) {
+        if (s.starts_with(str)) {
+            op = o;
+            s.remove_prefix(str.size());
+            break;
+        }
+    }
+    trim(s);
+    int c = 0;
+    auto r = std::from_chars(s.data(), s.data() + s.size(), c);
+    if (r.ec != std::errc{} || r.ptr != s.data() + s.size() || c < 0 || (op == HitOperator::Modulo && c == 0))
+        return false;
+    HitOp = op;
+    HitCount = c;
+    return true;
+}
+void debug_lua::BreakpointAction::SetLogMessage(std::string_view s)
+{
+    LogMessage.clear();
+    IsLog = !s.empty();
+    std::string text{};
+    size_t i = 0;
+    while (i < s.size()) {
+        char c = s[i];
+        if ((c == '{' || c == '}') && i + 1 < s.size() && s[i + 1] == c) {
+            text.push_back(c);
+            i += 2;
             continue;
-        for (auto l : b.Lines) {
-            BreakpointLookup.insert(std::make_pair(l, s));
         }
+        if (c == '{') {
+            size_t e = s.find('}', i + 1);
+            if (e != std::string_view::npos) {
+                if (!text.empty())
+                    LogMessage.emplace_back(std::move(text), false);
+                text = {};
+                LogMessage.emplace_back(std::string{ s.substr(i + 1, e - i - 1) }, true);
+                i = e + 1;
+                continue;
+            }
+        }
+        text.push_back(c);
+        ++i;
     }
+    if (!text.empty())
+        LogMessage.emplace_back(std::move(text), false);
+}
+bool debug_lua::BreakpointAction::CountHit() const
+{
+    ++Hits;
+    switch (HitOp) {
+    case HitOperator::Equal:
+        return Hits == HitCount;
+    case HitOperator::Greater:
+        return Hits > HitCount;
+    case HitOperator::GreaterEqual:
+        return Hits >= HitCount;
+    case HitOperator::Less:
+        return Hits < HitCount;
+    case HitOperator::LessEqual:
+        return Hits <= HitCount;
+    case HitOperator::Modulo:
+        return Hits % HitCount == 0;
+    default:
+        return true;
+    }
+}
+bool debug_lua::BreakpointAction::NeedsAction() const
+{
+    return !Condition.empty() || HitOp != HitOperator::None || IsLog;
+}
+
+debug_lua::BreakpointFile& debug_lua::Debugger::GetBreakpointFile(std::string_view sourceExternal)
+{
+    auto k = SourceRegistry::ExternalKey(sourceExternal);
+    auto it = Breakpoints.find(k);
+    if (it == Breakpoints.end())
+        it = Breakpoints.emplace(std::move(k), BreakpointFile{ std::string{ sourceExternal } }).first;
+    return it->second;
+}
+
+void debug_lua::Debugger::RebuildBreakpoints(const BreakpointFile& f)
+{
+    for (const auto* s : Sources.FindAllExternal(f.SourceExternal, true))
+        BindBreakpoints(*s, f);
     CheckHooked();
 }
 
+void debug_lua::Debugger::BindBreakpoints(const Source& s, const BreakpointFile& f)
+{
+    // entries might get removed or added, so the hook has to look them up again
+    BreakpointSourceCache.clear();
+    if (f.Lines.empty()) {
+        BreakpointIndex.erase(s.Internal);
+        return;
+    }
+    BreakpointLines bl{};
+    for (const auto& b : f.Lines) {
+        BreakpointAction a{};
+        a.Condition = b.Condition;
+        a.SetHitCondition(b.HitCondition); // already validated by the caller
+        a.SetLogMessage(b.LogMessage);
+        bl.Set(b.Line, std::move(a));
+    }
+    BreakpointIndex.insert_or_assign(s.Internal, std::move(bl));
+}
+
+// registry[&BreakpointSourceAnchorKey] = { [chunkname] = true }
+static char BreakpointSourceAnchorKey = 0;
+const debug_lua::BreakpointLines* debug_lua::Debugger::GetBreakpointLines(lua::State L, const char* src)
+{
+    auto c = BreakpointSourceCache.find(src);
+    if (c != BreakpointSourceCache.end())
+        return c->second;
+    const BreakpointLines* r = nullptr;
+    auto i = BreakpointIndex.find(std::string{ src });
+    if (i != BreakpointIndex.end())
+        r = &i->second;
+    // the cache is keyed by the address, so the string must not get collected (and the address reused for a different chunkname).
+    // lua strings are interned, pushing it again gives the same string.
+    int t = L.GetTop();
+    L.PushLightUserdata(&BreakpointSourceAnchorKey);
+    L.GetTableRaw(L.REGISTRYINDEX);
+    if (!L.IsTable(-1)) {
+        L.Pop(1);
+        L.NewTable();
+        L.PushLightUserdata(&BreakpointSourceAnchorKey);
+        L.PushValue(-2);
+        L.SetTableRaw(L.REGISTRYINDEX);
+    }
+    L.Push(src);
+    L.Push(true);
+    L.SetTableRaw(-3);
+    L.SetTop(t);
+    BreakpointSourceCache.emplace(src, r);
+    return r;
+}
+
 void debug_lua::Debugger::SetBreakSettings(BreakSettings s)
 {
     Brk = s;
@@ -194,56 +531,198 @@ void debug_lua::Debugger::SetBreakSettings(BreakSettings s)
 
 int debug_lua::Debugger::EvaluateInContext(std::string_view s, lua::State L, int lvl)
 {
-    std::string pre = "";
-    std::string post = "";
-    std::string var = "r";
     VarOverrideReset over{ Evaluating, true };
-    if (lvl >= 0 && L.Debug_IsStackLevelValid(lvl)) {
-        std::vector<std::string_view> varstaken{};
-        int num = 1;
-        while (const char* n = L.Debug_GetLocal(lvl, num)) {
-            L.Pop(1);
-            std::string_view s{ n };
-            if (IsIdentifier(s) && std::find(varstaken.begin(), varstaken.end(), s) == varstaken.end()) {
-                varstaken.push_back(s);
-                pre.append(std::format("local {} = LuaDebugger.GetLocal({}, {})\r\n", s, lvl+2, num));
-                post.append(std::format("LuaDebugger.SetLocal({}, {}, {})\r\n", lvl + 2, num, s));
-            }
+    int t = L.GetTop();
+    bool proxy = false, pushed = false;
+    // functions created by the expression keep its environment, so the proxy has to stop referring to the frame once done.
+    // the cached function gets the real globals back.
+    auto restore = [&]() {
+        if (!pushed)
+            return;
+        if (proxy)
+            DeactivateEvalEnvironment(L, t + 2);
+        L.PushGlobalTable();
+        L.SetFEnv(t + 1);
+    };
+    try {
+        PushEvalFunction(L, s);
+        proxy = lvl >= 0 && L.Debug_IsStackLevelValid(lvl);
+        if (proxy)
+            PushEvalEnvironment(L, lvl);
+        else
+            L.PushGlobalTable();
+        pushed = true;
+        L.PushValue(t + 1);
+        L.PushValue(t + 2);
+        L.SetFEnv(-2);
+        L.PCall(0, L.MULTIRET);
+    }
+    catch (const lua::LuaException&) {
+        restore();
+        L.SetTop(t);
+        throw;
+    }
+    restore();
+    L.Remove(t + 1);
+    L.Remove(t + 1);
+    return L.GetTop() - t;
+}
 
-            ++num;
-        }
-        lua::DebugInfo i{};
-        L.Debug_GetStack(lvl, i, lua::DebugInfoOptions::Line, true);
-        num = 1;
-        while (const char* n = L.Debug_GetUpvalue(-1, num)) {
+// registry[&EvalCacheKey] = { [expression] = function }
+static char EvalCacheKey = 0;
+void debug_lua::Debugger::PushEvalFunction(lua::State L, std::string_view expr)
+{
+    DebugState* s = States.Find(L.GetState());
+    if (s != nullptr) {
+        L.PushLightUserdata(&EvalCacheKey);
+        L.GetTableRaw(L.REGISTRYINDEX);
+        if (!L.IsTable(-1) || s->EvalCacheEntries >= MaxEvalCacheEntries) {
             L.Pop(1);
-            std::string_view s{ n };
-            if (IsIdentifier(s) && std::find(varstaken.begin(), varstaken.end(), s) == varstaken.end()) {
-                varstaken.push_back(s);
-                pre.append(std::format("local {} = LuaDebugger.GetUpvalue({}, {})\r\n", s, lvl + 2, num));
-                post.append(std::format("LuaDebugger.SetUpvalue({}, {}, {})\r\n", lvl + 2, num, s));
-            }
-
-            ++num;
+            L.NewTable();
+            L.PushLightUserdata(&EvalCacheKey);
+            L.PushValue(-2);
+            L.SetTableRaw(L.REGISTRYINDEX);
+            s->EvalCacheEntries = 0;
         }
-        L.Pop(1);
-        while (std::find(varstaken.begin(), varstaken.end(), var) != varstaken.end()) {
-            var.append("r");
+        L.Push(expr);
+        L.GetTableRaw(-2);
+        if (L.IsFunction(-1)) {
+            L.Remove(-2);
+            return;
         }
+        L.Pop(1);
     }
-    std::string asstatement = std::format("{0}local {1} = function()\r\n{3}\r\nend\r\n{1} = {{{1}()}}\r\n{2}return unpack({1})", pre, var, post, s);
-    std::string asexpresion = std::format("{0}local {1} = function()\r\nreturn {3}\r\nend\r\n{1} = {{{1}()}}\r\n{2}return unpack({1})", pre, var, post, s);
+
+    // expression or statement gets remembered via the cache
+    std::string asexpresion = std::format("return function()\r\nreturn {}\r\nend", expr);
+    std::string asstatement = std::format("return function()\r\n{}\r\nend", expr);
+    int t = L.GetTop();
     try {
-        return L.DoStringT(asexpresion, "from console");
+        L.DoStringT(asexpresion, "from console");
+    }
+    catch (const lua::LuaException&) {
+        L.SetTop(t);
+        L.DoStringT(asstatement, "from console");
+    }
+    L.SetTop(t + 1);
+
+    if (s != nullptr) {
+        L.Push(expr);
+        L.PushValue(-2);
+        L.SetTableRaw(-4);
+        ++s->EvalCacheEntries;
+        L.Remove(-2);
     }
-    catch (const lua::LuaException&) {}
-    return L.DoStringT(asstatement, "from console");
 }
 
-bool debug_lua::Debugger::IsIdentifier(std::string_view s)
+// the evaluated function sees this as its globals.
+// free names resolve lazily to the locals of the frame, then its upvalues, then the real globals.
+// the stack grows while evaluating, so the frame is lvl + (current depth - depth when the environment got created)
+void debug_lua::Debugger::PushEvalEnvironment(lua::State L, int lvl)
+{
+    int depth = L.Debug_GetStackDepth();
+    L.NewTable();
+    L.NewTable();
+    L.Push("__index");
+    L.Push(static_cast<double>(lvl));
+    L.Push(static_cast<double>(depth));
+    L.Push(lua::State::CppToCFunction<EvalIndex>, 2);
+    L.SetTableRaw(-3);
+    L.Push("__newindex");
+    L.Push(static_cast<double>(lvl));
+    L.Push(static_cast<double>(depth));
+    L.Push(lua::State::CppToCFunction<EvalNewIndex>, 2);
+    L.SetTableRaw(-3);
+    L.SetMetatable(-2);
+}
+// after the evaluation the frame is gone (or a different one), anything that still uses the environment only sees the real globals
+void debug_lua::Debugger::DeactivateEvalEnvironment(lua::State L, int idx)
+{
+    if (!L.GetMetatable(idx))
+        return;
+    L.Push("__index");
+    L.PushGlobalTable();
+    L.SetTableRaw(-3);
+    L.Push("__newindex");
+    L.PushGlobalTable();
+    L.SetTableRaw(-3);
+    L.Pop(1);
+}
+int debug_lua::Debugger::EvalTargetLevel(lua::State L)
 {
-    static std::regex reg{ "^[a-zA-Z_][a-zA-Z_0-9]*$", std::regex_constants::ECMAScript | std::regex_constants::optimize };
-    return std::regex_match(s.begin(), s.end(), reg);
+    int lvl = static_cast<int>(L.ToNumber(L.Upvalueindex(1)));
+    int depth = static_cast<int>(L.ToNumber(L.Upvalueindex(2)));
+    return lvl + L.Debug_GetStackDepth() - depth;
+}
+bool debug_lua::Debugger::AccessFrameVariable(lua::State L, int lvl, std::string_view name, int valueIdx)
+{
+    // later locals shadow earlier ones with the same name
+    int found = 0;
+    int num = 1;
+    while (const char* n = L.Debug_GetLocal(lvl, num)) {
+        L.Pop(1);
+        if (name == n)
+            found = num;
+        ++num;
+    }
+    if (found != 0) {
+        if (valueIdx == 0) {
+            L.Debug_GetLocal(lvl, found);
+        }
+        else {
+            L.PushValue(valueIdx);
+            L.Debug_SetLocal(lvl, found);
+        }
+        return true;
+    }
+
+    lua::DebugInfo i{};
+    if (!L.Debug_GetStack(lvl, i, lua::DebugInfoOptions::Line, true))
+        return false;
+    int func = L.GetTop();
+    num = 1;
+    while (const char* n = L.Debug_GetUpvalue(func, num)) {
+        L.Pop(1);
+        if (name == n) {
+            if (valueIdx == 0) {
+                L.Debug_GetUpvalue(func, num);
+            }
+            else {
+                L.PushValue(valueIdx);
+                L.Debug_SetUpvalue(func, num);
+            }
+            L.Remove(func);
+            return true;
+        }
+        ++num;
+    }
+    L.Pop(1);
+    return false;
+}
+int debug_lua::Debugger::EvalIndex(lua::State L)
+{
+    // 1 environment, 2 key
+    if (L.Type(2) == lua::LType::String && IsLuaIdentifier(L.ToStringView(2))) {
+        if (AccessFrameVariable(L, EvalTargetLevel(L), L.ToStringView(2), 0))
+            return 1;
+    }
+    L.PushGlobalTable();
+    L.PushValue(2);
+    L.GetTable(-2);
+    return 1;
+}
+int debug_lua::Debugger::EvalNewIndex(lua::State L)
+{
+    // 1 environment, 2 key, 3 value
+    if (L.Type(2) == lua::LType::String && IsLuaIdentifier(L.ToStringView(2))) {
+        if (AccessFrameVariable(L, EvalTargetLevel(L), L.ToStringView(2), 3))
+            return 0;
+    }
+    L.PushGlobalTable();
+    L.PushValue(2);
+    L.PushValue(3);
+    L.SetTable(-3);
+    return 0;
 }
 
 std::string debug_lua::Debugger::OutputString(lua::State L, int n)
@@ -270,11 +749,10 @@ std::string debug_lua::Debugger::OutputString(lua::State L, int n)
 
 std::string debug_lua::Debugger::ToDebugString_Format::LuaFuncSourceFormat(lua::State L, int index, const lua::DebugInfo& d)
 {
-    L.PushLightUserdata(&Debugger::Hook);
-    L.GetTableRaw(L.REGISTRYINDEX);
-    auto th = static_cast<Debugger*>(L.ToUserdata(-1));
-    L.Pop(1);
-    auto src = d.Source == nullptr ? "" : th->FindSource(th->GetState(L.GetState()), d.Source);
+    auto* c = GetHookContext(L.GetState());
+    std::string src{};
+    if (d.Source != nullptr)
+        src = c == nullptr ? std::string{ d.Source } : c->Dbg->FindSource(*c->State, d.Source);
     return std::format("{}:{}", src, d.LineDefined);
 }
 std::string debug_lua::Debugger::ToDebugString_Format::StringFormat(lua::State L, int index)
@@ -303,13 +781,7 @@ std::string debug_lua::Debugger::TranslateSourceString(const DebugState& s, std:
 debug_lua::Source* debug_lua::Debugger::SearchInternal(std::string_view i)
 {
     std::unique_lock lo{ StatesMutex };
-    for (DebugState& r : States) {
-        for (auto& s : r.SourcesLoaded) {
-            if (s.Internal == i)
-                return &s;
-        }
-    }
-    return nullptr;
+    return Sources.FindInternal(i);
 }
 debug_lua::Source* debug_lua::Debugger::SearchExternal(std::string_view e)
 {
@@ -318,16 +790,7 @@ debug_lua::Source* debug_lua::Debugger::SearchExternal(std::string_view e)
 }
 debug_lua::Source* debug_lua::Debugger::SearchExternalUnsafe(std::string_view e, bool fileOnly)
 {
-    for (DebugState& r : States) {
-        for (auto& s : r.SourcesLoaded) {
-            std::string_view se = s.External;
-            if (fileOnly)
-                se = SourceToFileAndArchive(se).first;
-            if (una::caseless::compare_utf8(se, e) == 0)
-                return &s;
-        }
-    }
-    return nullptr;
+    return Sources.FindExternal(e, fileOnly);
 }
 std::string debug_lua::Debugger::FindSource(const DebugState& s, std::string_view i)
 {
@@ -343,87 +806,276 @@ void debug_lua::Debugger::RunCallback()
     CheckRun();
     if (MapJustOpened) {
         std::unique_lock lo{ StatesMutex };
-        for (size_t i = 1; i < States.size(); ++i) {
-            CheckSourcesLoaded(States[i]);
+        for (auto& s : States) {
+            if (&s != &States.First()) // main menu
+                CheckSourcesLoaded(s);
         }
         MapJustOpened = false;
     }
 }
 void debug_lua::Debugger::CheckRun()
 {
-    if (!HasTasks)
+    // reset before taking, so a task pushed after this gets its own message.
+    // also if the queue is empty, a message posted while the last CheckRun was draining would otherwise leave it set forever.
+    CheckRunPosted = false;
+    if (Tasks.Empty())
         return;
-    while (true) {
-        LuaExecutionTask* t;
-        {
-            std::unique_lock l{ DataMutex };
-            if (Tasks.empty()) {
-                HasTasks = false;
-                return;
-            }
-            t = Tasks.front();
-            Tasks.pop_front();
+    while (LuaExecutionTask* t = Tasks.TakeAll()) {
+        while (t != nullptr) {
+            LuaExecutionTask* n = t->Next; // t might be gone after Work
+            t->Work();
+            t = n;
         }
-        t->Work();
     }
 }
 
+void debug_lua::Debugger::SetHookContext(DebugState& s, bool open)
+{
+    auto& c = HookContexts[s.Handle.Slot];
+    if (open) {
+        c.Dbg = this;
+        c.State = &s;
+        c.L.store(s.L, std::memory_order_release);
+    }
+    else {
+        c.L.store(nullptr, std::memory_order_release);
+    }
+}
+debug_lua::Debugger::HookContext* debug_lua::Debugger::GetHookContext(lua_State* L)
+{
+    for (auto& c : HookContexts) {
+        if (c.L.load(std::memory_order_acquire) == L)
+            return &c;
+    }
+    return nullptr;
+}
+
 void debug_lua::Debugger::CheckHooked()
 {
-    bool h = Re != Request::Resume || !BreakpointLookup.empty();
+    if (Handler == nullptr)
+        Mode = HookMode::None;
+    else if (Re == Request::StepToLevel || Re == Request::BreakpointAtLevel)
+        Mode = HookMode::Step;
+    else if (Re != Request::Resume)
+        Mode = HookMode::Line;
+    else if (InterruptRequested)
+        Mode = HookMode::Interrupt;
+    else if (!BreakpointIndex.empty())
+        Mode = HookMode::Function;
+    else
+        Mode = HookMode::None;
     for (auto& s : States)
-        SetHooked(s, h, LineFix);
+        SetHooked(s, Mode, LineFix);
 }
-void debug_lua::Debugger::SetHooked(DebugState& s, bool h, bool imm)
+void debug_lua::Debugger::ScheduleCheckHooked()
+{
+    if (SHoKThread == std::this_thread::get_id()) {
+        CheckHooked();
+        return;
+    }
+    RunInSHoKThread(*new LuaExecutionCallbackTask{ [this]() {
+        std::unique_lock lo{ StatesMutex };
+        CheckHooked();
+        } });
+}
+void debug_lua::Debugger::SetHooked(DebugState& s, HookMode m, bool imm)
 {
     lua::State L{ s.L };
-    if (h) {
-        auto e = lua::HookEvent::Line;
-        if (imm)
-            e = e | lua::HookEvent::Count;
-        L.Debug_SetHook<Hook>(e, 1);
+    switch (m) {
+    case HookMode::Line:
+        SetHook(L, lua::HookEvent::Line, imm);
+        break;
+    case HookMode::Function:
+        // we do not know which function is currently running, so start with line hook, the next call/return fixes it
+        s.LineHookArmed = true;
+        SetHook(L, lua::HookEvent::Call | lua::HookEvent::Return | lua::HookEvent::Line, false);
+        break;
+    case HookMode::Step:
+        // depth is unknown until the next event, so start with line hook
+        s.LineHookArmed = true;
+        s.Depth = -1;
+        SetHook(L, lua::HookEvent::Call | lua::HookEvent::Return | lua::HookEvent::Line, imm);
+        break;
+    case HookMode::Interrupt:
+        SetHook(L, lua::HookEvent{}, true);
+        break;
+    default:
+        SetHook(L, lua::HookEvent{}, false);
+        break;
     }
-    else {
-        L.Debug_SetHook<Hook>(lua::HookEvent::Count, 50000); // so we can pause in infinite loops
+}
+void debug_lua::Debugger::SetHook(lua::State L, lua::HookEvent e, bool everyInstruction)
+{
+    int count = 0;
+    if (everyInstruction) {
+        e = e | lua::HookEvent::Count;
+        count = 1;
+    }
+    else if (Profiler.IsRunning()) {
+        e = e | lua::HookEvent::Count;
+        count = Profiler.GetInterval();
+    }
+    if (CallProfiling)
+        e = e | lua::HookEvent::Call | lua::HookEvent::Return;
+    L.Debug_SetHook<Hook>(e, count);
+}
+void debug_lua::Debugger::ArmFunctionLineHook(lua::State L, DebugState& s, lua::ActivationRecord ar)
+{
+    bool arm = false;
+    if (Mode == HookMode::Step)
+        arm = TrackDepth(L, s, ar) <= StepToLevel;
+    if (!arm && !BreakpointIndex.empty()) {
+        if (ar.Matches(lua::HookEvent::Call)) {
+            arm = FunctionMayHaveBreakpoint(L, L.Debug_GetInfoFromAR(ar, lua::DebugInfoOptions::Source));
+        }
+        else {
+            // return (or tail return), the function we return to is the one that gets executed next
+            lua::DebugInfo i{};
+            if (L.Debug_GetStack(1, i, lua::DebugInfoOptions::Source, false))
+                arm = FunctionMayHaveBreakpoint(L, i);
+        }
+    }
+    SetLineHookArmed(L, s, arm);
+}
+void debug_lua::Debugger::SetLineHookArmed(lua::State L, DebugState& s, bool arm)
+{
+    if (arm == s.LineHookArmed)
+        return;
+    s.LineHookArmed = arm;
+    auto e = lua::HookEvent::Call | lua::HookEvent::Return;
+    if (arm)
+        e = e | lua::HookEvent::Line;
+    // LineFix needs the count hook until the first line event after a pause
+    SetHook(L, e, LineFix);
+}
+// lua 5.0 counts lost tail calls as stack levels. they get a call event each and a tail return event each, so the counter matches.
+// errors unwind without return events, Hooks::PCallErrors tells when that happened.
+int debug_lua::Debugger::CurrentDepth(lua::State L, DebugState& s)
+{
+    if (s.Depth < 0 || s.DepthErrors != Hooks::PCallErrors) {
+        s.Depth = L.Debug_GetStackDepth();
+        s.DepthErrors = Hooks::PCallErrors;
+    }
+    return s.Depth;
+}
+int debug_lua::Debugger::TrackDepth(lua::State L, DebugState& s, lua::ActivationRecord ar)
+{
+    bool known = s.Depth >= 0 && s.DepthErrors == Hooks::PCallErrors;
+    int d = CurrentDepth(L, s); // if freshly synchronized, it contains the function of this event already
+    if (known && ar.Matches(lua::HookEvent::Call))
+        ++d;
+    else if (!ar.Matches(lua::HookEvent::Call))
+        --d; // return (or tail return), the function is still on the stack while the hook runs
+    s.Depth = d;
+    return d;
+}
+bool debug_lua::Debugger::FunctionMayHaveBreakpoint(lua::State L, const lua::DebugInfo& i)
+{
+    if (i.Source == nullptr)
+        return true;
+    auto* bl = GetBreakpointLines(L, i.Source);
+    return bl != nullptr && bl->MayContainFrom(i.LineDefined);
+}
+
+bool debug_lua::Debugger::CheckBreakpointAction(lua::State L, const BreakpointAction* a)
+{
+    if (a == nullptr)
+        return true;
+    int t = L.GetTop();
+    if (!a->Condition.empty()) {
+        try {
+            int n = EvaluateInContext(a->Condition, L, 0);
+            bool r = n > 0 && L.ToBoolean(t + 1);
+            L.SetTop(t);
+            if (!r)
+                return false;
+        }
+        catch (const lua::LuaException& e) {
+            // better stop than silently ignoring it
+            if (Handler)
+                Handler->OnLog(std::format("Breakpoint condition '{}' failed: {}\r\n", a->Condition, EnsureUTF8(e.what())));
+            return true;
+        }
     }
+    if (!a->CountHit())
+        return false;
+    if (!a->IsLog)
+        return true;
+    if (Handler == nullptr)
+        return false;
+
+    std::string msg{};
+    for (const auto& [str, isexpr] : a->LogMessage) {
+        if (!isexpr) {
+            msg.append(str);
+            continue;
+        }
+        try {
+            int n = EvaluateInContext(str, L, 0);
+            for (int i = t + 1; i <= t + n; ++i) {
+                if (i > t + 1)
+                    msg.append(", ");
+                if (L.Type(i) == lua::LType::String)
+                    msg.append(EnsureUTF8(L.ToStringView(i)));
+                else
+                    msg.append(EnsureUTF8(L.ToDebugString<ToDebugString_Format>(i)));
+            }
+        }
+        catch (const lua::LuaException& e) {
+            msg.append(std::format("<{}>", EnsureUTF8(e.what())));
+        }
+        L.SetTop(t);
+    }
+    msg.append("\r\n");
+    Handler->OnLog(msg);
+    return false;
 }
 
 void debug_lua::Debugger::WaitForRequest()
 {
     CheckRun();
     HadForeground = GetForegroundWindow() == *shok::MainWindowHandle;
-    while (Re == Request::Pause)
-    {
-        std::this_thread::sleep_for(std::chrono::milliseconds{ 10 });
-        ProcessBasicWindowEvents();
-        CheckRun();
+    if (Re == Request::Pause) {
+        auto pausedAt = CallProfile::Clock::now();
+        while (Re == Request::Pause)
+        {
+            Wake.WaitOrMessage();
+            ProcessBasicWindowEvents();
+            CheckRun();
+        }
+        PausedTime += CallProfile::Clock::now() - pausedAt;
     }
     if (HadForeground)
         SetForegroundWindow(*shok::MainWindowHandle);
 }
 void debug_lua::Debugger::TranslateRequest(lua::State L)
 {
-    std::unique_lock l{ DataMutex };
-    if (Re == Request::StepIn) {
-        Re = Request::StepToLevel;
-        StepToLevel = L.Debug_GetStackDepth() + 1;
-    }
-    else if (Re == Request::StepLine) {
+    if (Re != Request::StepIn && Re != Request::StepLine && Re != Request::StepOut)
+        return;
+    int depth = L.Debug_GetStackDepth();
+    {
+        std::unique_lock l{ DataMutex };
+        if (Re == Request::StepIn)
+            StepToLevel = depth + 1;
+        else if (Re == Request::StepLine)
+            StepToLevel = depth;
+        else if (Re == Request::StepOut)
+            StepToLevel = depth - 1;
+        else
+            return;
         Re = Request::StepToLevel;
-        StepToLevel = L.Debug_GetStackDepth();
     }
-    else if (Re == Request::StepOut) {
-        Re = Request::StepToLevel;
-        StepToLevel = L.Debug_GetStackDepth() - 1;
+    // from here on, call/return events keep track of the depth
+    std::unique_lock lo{ StatesMutex };
+    CheckHooked();
+    if (auto* s = States.Find(L.GetState())) {
+        s->Depth = depth;
+        s->DepthErrors = Hooks::PCallErrors;
     }
 }
 
 void debug_lua::Debugger::InitializeLua(lua::State L, bool mainmenu, lua::CFunction shutdown)
 {
-    L.PushLightUserdata(&Debugger::Hook);
-    L.PushLightUserdata(this);
-    L.SetTableRaw(L.REGISTRYINDEX);
-
     std::array lib{
         lua::FuncReference::GetRef<Debugger, &Debugger::Log>(*this, "Log"),
         lua::FuncReference::GetRef<Debugger, &Debugger::IsDebuggerAttached>(*this, "IsDebuggerAttached"),
@@ -477,30 +1129,62 @@ void debug_lua::Debugger::CheckSourcesLoadedFunc(DebugState& s, int idx)
     L.PushValue(idx);
     lua::DebugInfo i = L.Debug_GetInfoForFunc(lua::DebugInfoOptions::Source);
     auto src = i.Source == nullptr ? "" : std::string_view{ i.Source };
-    if (std::find_if(s.SourcesLoaded.begin(), s.SourcesLoaded.end(), [src](const Source& s) { return s.Internal == src; }) == s.SourcesLoaded.end()) {
+    if (std::find_if(s.SourcesLoaded.begin(), s.SourcesLoaded.end(), [src](const auto& s) { return s->Internal == src; }) == s.SourcesLoaded.end()) {
         DoAddSource(s, src);
     }
 }
 
 void debug_lua::Debugger::DoAddSource(DebugState& s, std::string_view src)
 {
-    auto& f = s.SourcesLoaded.emplace_back(std::string(src), TranslateSourceString(s, src));
+    auto& f = *s.SourcesLoaded.emplace_back(std::make_unique<Source>(std::string(src), TranslateSourceString(s, src)));
+    Sources.Add(&f);
     if (Handler)
         Handler->OnSourceAdded(s, f.External);
-    RebuildBreakpoints();
+    auto b = Breakpoints.find(SourceRegistry::ExternalKey(SourceToFileAndArchive(f.External).first));
+    if (b != Breakpoints.end()) {
+        BindBreakpoints(f, b->second);
+        CheckHooked();
+    }
 }
 
 void debug_lua::Debugger::Hook(lua::State L, lua::ActivationRecord ar)
 {
-    L.PushLightUserdata(&Debugger::Hook);
-    L.GetTableRaw(L.REGISTRYINDEX);
-    auto* th = static_cast<Debugger*>(L.ToUserdata(-1));
-    L.Pop(1);
-    auto& s = th->GetState(L.GetState());
+    auto* c = GetHookContext(L.GetState());
+    if (c == nullptr)
+        return;
+    auto* th = c->Dbg;
+    auto& s = *c->State;
 
     if (th->Evaluating)
         return;
 
+    if (th->InterruptRequested.exchange(false)) {
+        // someone waits for a task, but we are not getting back to the message loop
+        th->CheckRun();
+        std::unique_lock lo{ th->StatesMutex };
+        th->CheckHooked();
+    }
+
+    if (ar.Matches(lua::HookEvent::Count) && th->Profiler.IsRunning() && th->Mode != HookMode::Interrupt && !th->LineFix) {
+        // count events are only there for sampling in this case
+        th->Profiler.Sample(L, s);
+        return;
+    }
+
+    if (!ar.Matches(lua::HookEvent::Line) && !ar.Matches(lua::HookEvent::Count)) {
+        // call/return
+        if (th->CallProfiling && s.Calls != nullptr) {
+            auto now = CallProfile::Clock::now() - th->PausedTime;
+            if (ar.Matches(lua::HookEvent::Call))
+                s.Calls->OnCall(L, ar, now);
+            else
+                s.Calls->OnReturn(L, now);
+        }
+        if (th->Mode == HookMode::Function || th->Mode == HookMode::Step)
+            th->ArmFunctionLineHook(L, s, ar);
+        return;
+    }
+
     int line = -1;
     bool checkBreakpoint = false;
 
@@ -535,25 +1219,21 @@ void debug_lua::Debugger::Hook(lua::State L, lua::ActivationRecord ar)
         if (th->Handler)
             th->Handler->OnPaused(s, Reason::Pause, "");
     }
-    else if (checkBreakpoint && !th->BreakpointLookup.empty() && th->St == Status::Running) {
+    else if (checkBreakpoint && !th->BreakpointIndex.empty() && th->St == Status::Running) {
         auto dinf = L.Debug_GetInfoFromAR(ar, lua::DebugInfoOptions::Source);
         if (dinf.Source != nullptr) {
-            auto [it, end] = th->BreakpointLookup.equal_range(line);
-            std::string_view src = dinf.Source;
-            for (; it != end; ++it) {
-                auto& [key, sr] = *it;
-                if (src == sr->Internal) {
-                    th->Re = Request::Pause;
-                    th->St = Status::Paused;
-                    if (th->Handler)
-                        th->Handler->OnPaused(s, Reason::Breakpoint, "");
-                }
+            auto* bl = th->GetBreakpointLines(L, dinf.Source);
+            if (bl != nullptr && bl->Has(line) && th->CheckBreakpointAction(L, bl->GetAction(line))) {
+                th->Re = Request::Pause;
+                th->St = Status::Paused;
+                if (th->Handler)
+                    th->Handler->OnPaused(s, Reason::Breakpoint, "");
             }
         }
     }
 
     if (th->Re == Request::StepToLevel || th->Re == Request::BreakpointAtLevel) {
-        int lvl = L.Debug_GetStackDepth();
+        int lvl = th->Mode == HookMode::Step ? th->CurrentDepth(L, s) : L.Debug_GetStackDepth();
         if (th->StepToLevel >= lvl) {
             th->Re = Request::Pause;
             th->St = Status::Paused;
@@ -569,10 +1249,10 @@ void debug_lua::Debugger::Hook(lua::State L, lua::ActivationRecord ar)
 
 int debug_lua::Debugger::ErrorFunc(lua::State L)
 {
-    L.PushLightUserdata(&Debugger::Hook);
-    L.GetTableRaw(L.REGISTRYINDEX);
-    auto th = static_cast<Debugger*>(L.ToUserdata(-1));
-    L.Pop(1);
+    auto* c = GetHookContext(L.GetState());
+    if (c == nullptr)
+        return 1;
+    auto* th = c->Dbg;
 
     if (!th->Handler)
         return 1;
@@ -580,20 +1260,19 @@ int debug_lua::Debugger::ErrorFunc(lua::State L)
         return 1;
 
     BreakSettings tocheck = BreakSettings::PCall;
-    if (L.IsLightUserdata(L.Upvalueindex(1))) {
-        auto* di = static_cast<lua::DebugInfo*>(L.ToUserdata(L.Upvalueindex(1)));
-        if (di->What == std::string_view("C") && di->NameWhat == std::string_view("global") && (di->Name == std::string_view("xpcall") || di->Name == std::string_view("pcall")))
+    int caller = Hooks::PCallCallerLevel(L.GetState());
+    lua::DebugInfo di{};
+    if (caller >= 0 && L.Debug_GetStack(caller, di, lua::DebugInfoOptions::Name | lua::DebugInfoOptions::Source, false)) {
+        if (di.What == std::string_view("C") && di.NameWhat == std::string_view("global") && (di.Name == std::string_view("xpcall") || di.Name == std::string_view("pcall")))
             tocheck = BreakSettings::XPCall;
     }
     if ((tocheck & th->Brk) == BreakSettings::None)
         return 1;
 
-    auto& s = th->GetState(L.GetState());
-
     th->St = Status::Paused;
     th->Re = Request::Pause;
     
-    th->Handler->OnPaused(s, Reason::Exception, L.ToStringView(1));
+    th->Handler->OnPaused(*c->State, Reason::Exception, L.ToStringView(1));
 
     th->WaitForRequest();
     th->TranslateRequest(L);
@@ -604,23 +1283,21 @@ int debug_lua::Debugger::ErrorFunc(lua::State L)
 void debug_lua::Debugger::SyntaxErrorFunc(lua_State* l, int err)
 {
     lua::State L{ l };
-    L.PushLightUserdata(&Debugger::Hook);
-    L.GetTableRaw(L.REGISTRYINDEX);
-    auto th = static_cast<Debugger*>(L.ToUserdata(-1));
-    L.Pop(1);
+    auto* c = GetHookContext(l);
+    if (c == nullptr)
+        return;
+    auto* th = c->Dbg;
 
     if (!th->Handler)
         return;
     if (th->Evaluating)
         return;
 
-    auto& s = th->GetState(L.GetState());
-
     th->St = Status::Paused;
     th->Re = Request::Pause;
 
     auto msg = std::format("{}: {}", L.ErrorCodeFormat(static_cast<lua::ErrorCode>(err)), L.ToStringView(-1));
-    th->Handler->OnPaused(s, Reason::Exception, msg);
+    th->Handler->OnPaused(*c->State, Reason::Exception, msg);
 
     th->WaitForRequest();
     th->TranslateRequest(L);
@@ -1,12 +1,24 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
+#include <functional>
 #include <future>
 #include <map>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "luapp/luapp50.h"
 #include "enumflags.h"
+#include "profiler.h"
+#include "winhelpers.h"
 
 namespace debug_lua {
 	struct Source {
@@ -14,13 +26,101 @@ namespace debug_lua {
 
 		auto operator<=>(const Source&) const noexcept = default;
 	};
+	// identifies a slot in DebugStateTable. Generation changes every time the slot gets freed, so stale handles can be detected.
+	struct DebugStateHandle {
+		static constexpr unsigned SlotBits = 2, GenerationBits = 12; // 4096 reloads until a stale handle could validate again
+
+		uint16_t Slot : SlotBits = 0;
+		uint16_t Generation : GenerationBits = 0;
+
+		auto operator<=>(const DebugStateHandle&) const noexcept = default;
+	};
 	class DebugState {
 	public:
 		lua_State* L;
 		const char* Name;
-		std::vector<Source> SourcesLoaded;
+		std::vector<std::unique_ptr<Source>> SourcesLoaded; // pointers stay valid, SourceRegistry refers to them
 		std::string MapFile;
 		std::string MapScriptFile;
+		bool LineHookArmed = false;
+		int Depth = -1; // call depth tracked by call/return hooks while stepping, -1 if unknown, see Debugger::TrackDepth
+		unsigned int DepthErrors = 0; // Hooks::PCallErrors when Depth was last synchronized
+		DebugStateHandle Handle{};
+		int EvalCacheEntries = 0; // compiled evaluation functions in the registry, see Debugger::PushEvalFunction
+		std::unique_ptr<CallProfile> Calls; // allocated on the first Debugger::StartCallProfile, kept until the state closes
+	};
+
+	// fixed slots, a DebugState never moves until its lua state closes.
+	// Add/Remove only from the shok thread under Debugger::StatesMutex.
+	// Get/Find from the shok thread (or under StatesMutex), on any other thread Remove could destroy the returned state while it is in use.
+	class DebugStateTable {
+	public:
+		static constexpr size_t MaxStates = 1 << DebugStateHandle::SlotBits; // shok never has more than main menu + ingame open
+
+	private:
+		struct Slot {
+			std::optional<DebugState> State;
+			std::atomic<lua_State*> L = nullptr; // nullptr if free
+			std::atomic<uint16_t> Generation = 0;
+		};
+		std::array<Slot, MaxStates> Slots;
+
+		template<class S, class T>
+		class Iterator {
+			S* Cur;
+			S* End;
+
+			void Skip() {
+				while (Cur != End && !Cur->State.has_value())
+					++Cur;
+			}
+		public:
+			Iterator(S* c, S* e) : Cur(c), End(e) {
+				Skip();
+			}
+			T& operator*() const {
+				return *Cur->State;
+			}
+			T* operator->() const {
+				return &*Cur->State;
+			}
+			Iterator& operator++() {
+				++Cur;
+				Skip();
+				return *this;
+			}
+			bool operator==(const Iterator& o) const {
+				return Cur == o.Cur;
+			}
+		};
+
+	public:
+		// takes the lowest free slot, so the main menu state always ends up in slot 0
+		DebugState& Add(lua_State* l, const char* name);
+		void Remove(DebugState& s);
+		// nullptr if the handle is stale
+		DebugState* Get(DebugStateHandle h);
+		DebugState* Find(lua_State* l);
+		size_t Count() const;
+		inline bool Empty() const {
+			return Count() == 0;
+		}
+		// first/last used slot, the table must not be empty
+		DebugState& First();
+		DebugState& Last();
+
+		auto begin() {
+			return Iterator<Slot, DebugState>{ Slots.data(), Slots.data() + Slots.size() };
+		}
+		auto end() {
+			return Iterator<Slot, DebugState>{ Slots.data() + Slots.size(), Slots.data() + Slots.size() };
+		}
+		auto begin() const {
+			return Iterator<const Slot, const DebugState>{ Slots.data(), Slots.data() + Slots.size() };
+		}
+		auto end() const {
+			return Iterator<const Slot, const DebugState>{ Slots.data() + Slots.size(), Slots.data() + Slots.size() };
+		}
 	};
 
 	enum class Reason : int {
@@ -41,36 +141,89 @@ namespace debug_lua {
 
 	struct IDebugEventHandler {
 		virtual void OnStateOpened(DebugState& s) = 0;
+		// called with Debugger::StatesMutex locked, use Debugger::SetHandlerLocked to detach
 		virtual void OnStateClosing(DebugState& s, bool lastState) = 0;
+		// shok thread, StatesMutex not locked
 		virtual void OnPaused(DebugState& s, Reason r, std::string_view exceptionText) = 0;
 		virtual void OnLog(std::string_view s) = 0;
 		virtual void OnSourceAdded(DebugState& s, std::string_view f) = 0;
 		virtual void OnShutdown() = 0;
 	};
 
-	bool operator==(DebugState d, lua_State* l);
+	// all loaded sources of all states, indexed by internal and (case folded) external name.
+	// gets updated whenever a source gets loaded or a state closes.
+	class SourceRegistry {
+		std::unordered_multimap<std::string_view, Source*> ByInternal; // keys point into Source::Internal
+		std::unordered_multimap<std::string, Source*> ByExternal;
+		std::unordered_multimap<std::string, Source*> ByExternalFile; // without archive
+
+	public:
+		void Add(Source* s);
+		void Remove(const Source* s);
+		Source* FindInternal(std::string_view i) const;
+		Source* FindExternal(std::string_view e, bool fileOnly) const;
+		std::vector<Source*> FindAllExternal(std::string_view e, bool fileOnly) const;
+
+		static std::string ExternalKey(std::string_view e);
+	};
 
 	class LuaExecutionTask {
 		friend class Debugger;
+		friend class LuaExecutionTaskQueue;
+		LuaExecutionTask* Next = nullptr;
 	protected:
 		virtual void Work() = 0;
 	};
+
+	// intrusive lock free queue, any thread may push, only the shok thread takes.
+	// tasks must stay alive until they got executed.
+	class LuaExecutionTaskQueue {
+		std::atomic<LuaExecutionTask*> Head = nullptr;
+
+	public:
+		void Push(LuaExecutionTask& t);
+		// takes all queued tasks at once, in the order they were pushed (linked via Next)
+		LuaExecutionTask* TakeAll();
+		inline bool Empty() const {
+			return Head.load(std::memory_order_relaxed) == nullptr;
+		}
+	};
 	template<class R, class... A>
 	class LuaExecutionPackagedTask : public LuaExecutionTask {
 		std::packaged_task<R(A...)> Task;
+		std::future<R> Future;
 
 	public:
 		template<class C>
-		LuaExecutionPackagedTask(C&& c) : Task(std::forward<C>(c)) {}
+		LuaExecutionPackagedTask(C&& c) : Task(std::forward<C>(c)), Future(Task.get_future()) {}
 
 		R Get() {
-			auto f = Task.get_future();
-			return f.get();
+			return Future.get();
+		}
+		// true if the task got executed within d
+		template<class Rep, class Per>
+		bool WaitFor(const std::chrono::duration<Rep, Per>& d) {
+			return Future.wait_for(d) == std::future_status::ready;
+		}
+
+	protected:
+		virtual void Work() override {
+			Task();
 		}
+	};
+
+	// does not block, the result has to be passed on by the task itself. deletes itself after execution.
+	class LuaExecutionCallbackTask : public LuaExecutionTask {
+		std::function<void()> Task;
+
+	public:
+		template<class C>
+		LuaExecutionCallbackTask(C&& c) : Task(std::forward<C>(c)) {}
 
 	protected:
 		virtual void Work() override {
 			Task();
+			delete this;
 		}
 	};
 
@@ -91,9 +244,68 @@ namespace debug_lua {
 		void operator=(VarOverrideReset&&) = delete;
 	};
 
+	struct Breakpoint {
+		int Line = 0;
+		std::string Condition; // lua expression, empty if always
+		std::string HitCondition; // [op] count, see BreakpointAction::SetHitCondition
+		std::string LogMessage; // logs instead of pausing if not empty, {expression} gets replaced
+	};
 	struct BreakpointFile {
 		std::string SourceExternal;
-		std::vector<int> Lines;
+		std::vector<Breakpoint> Lines;
+	};
+
+	// everything a breakpoint does besides just pausing, only exists for lines that need it
+	struct BreakpointAction {
+		enum class HitOperator : int {
+			None,
+			Equal,
+			Greater,
+			GreaterEqual,
+			Less,
+			LessEqual,
+			Modulo,
+		};
+
+		std::string Condition;
+		HitOperator HitOp = HitOperator::None;
+		int HitCount = 0;
+		mutable int Hits = 0; // only counted if Condition was true
+		bool IsLog = false;
+		std::vector<std::pair<std::string, bool>> LogMessage; // text or expression (true)
+
+		// [op] count, op is one of == > >= < <= %, default ==. false if s is not valid
+		bool SetHitCondition(std::string_view s);
+		// splits into text and {expression}, {{ and }} are escaped braces
+		void SetLogMessage(std::string_view s);
+		// counts a hit, true if the hit condition is satisfied
+		bool CountHit() const;
+		bool NeedsAction() const;
+	};
+
+	// dense bitset of all lines in one source, that have a breakpoint
+	class BreakpointLines {
+		std::vector<bool> Lines;
+		std::unordered_map<int, BreakpointAction> Actions;
+
+	public:
+		void Set(int line);
+		void Set(int line, BreakpointAction&& a);
+		inline bool Has(int line) const {
+			return line >= 0 && static_cast<size_t>(line) < Lines.size() && Lines[line];
+		}
+		// nullptr if the line just pauses
+		inline const BreakpointAction* GetAction(int line) const {
+			if (Actions.empty())
+				return nullptr;
+			auto it = Actions.find(line);
+			return it == Actions.end() ? nullptr : &it->second;
+		}
+		// lua 5.0 does not tell us where a function ends, so anything after its start might be in it.
+		// the last bit is always set, so this is just a size check.
+		inline bool MayContainFrom(int lineDefined) const {
+			return static_cast<size_t>(std::max(lineDefined, 0)) < Lines.size();
+		}
 	};
 
 	class Debugger {
@@ -113,43 +325,101 @@ namespace debug_lua {
 		};
 		static constexpr int MaxTableExpandLevels = 10;
 		static constexpr std::string_view MapScript = "Map Script";
+		// if the shok thread did not pick up a pause within this time, it is probably stuck in lua, see Interrupt
+		static constexpr std::chrono::milliseconds InterruptDelay{ 100 };
+		// the whole cache of a state gets dropped if it grows larger than this
+		static constexpr int MaxEvalCacheEntries = 256;
 
 	private:
-		std::vector<DebugState> States;
+		// lets the hook and error handlers find their debugger and state without locking or touching the lua stack.
+		// indexed like the DebugStateTable slots, only written from the shok thread, under StatesMutex.
+		struct HookContext {
+			std::atomic<lua_State*> L = nullptr;
+			Debugger* Dbg = nullptr;
+			DebugState* State = nullptr;
+		};
+		static inline std::array<HookContext, DebugStateTable::MaxStates> HookContexts{};
+
+		enum class HookMode : int {
+			None, // idle or no client attached, no overhead at all
+			Interrupt, // count 1, only until the shok thread executed the pending tasks
+			Function, // call/return, line only while in a function that might have a breakpoint
+			Step, // call/return, line only while at or above StepToLevel (or for breakpoints, as Function)
+			Line,
+		};
+
+		DebugStateTable States;
+		SourceRegistry Sources;
 
 		std::mutex DataMutex;
-		std::list<LuaExecutionTask*> Tasks;
-		bool HasTasks = false, LineFix = false, Evaluating = false, MapJustOpened = false;
+		LuaExecutionTaskQueue Tasks;
+		std::atomic<bool> CheckRunPosted = false; // only keep one WM_CHECK_RUN in the message queue
+		WakeEvent Wake; // wakes WaitForRequest for new tasks and requests
+		bool LineFix = false, Evaluating = false, MapJustOpened = false;
 		BreakSettings Brk = BreakSettings::None;
+		HookMode Mode = HookMode::None;
+		std::atomic<bool> InterruptRequested = false;
+		SamplingProfiler Profiler;
+		bool CallProfiling = false;
+		CallProfile::Clock::duration PausedTime{}; // total time spent in WaitForRequest paused, gets excluded from call profiles
 		int LineFixLine = -1, LineFixLevel = 0;
-		std::multimap<int, Source*> BreakpointLookup;
+		// Source::Internal -> lines
+		std::unordered_map<std::string, BreakpointLines> BreakpointIndex;
+		// interned lua chunkname (as in DebugInfo::Source) -> lines (nullptr if the source has no breakpoints).
+		// lua reuses the same string for all functions of a chunk, so this avoids string compares in the hook.
+		// the chunknames get anchored in the registry, so their addresses stay unique while cached.
+		// gets cleared with BreakpointIndex and when a state closes.
+		std::unordered_map<const char*, const BreakpointLines*> BreakpointSourceCache;
 		bool HadForeground = false;
+		std::thread::id SHoKThread{}; // set by the first OnStateAdded, under StatesMutex
 
 	public:
-		IDebugEventHandler* Handler = nullptr;
+		IDebugEventHandler* Handler = nullptr; // use SetHandler to attach, so the hooks get installed
 		Status St = Status::Running;
 		Request Re = Request::Resume;
 		int StepToLevel = 0;
-		std::vector<BreakpointFile> Breakpoints; // call RebuildBreakpoints after modifying, otherwise you get dangling pointers!
+		std::unordered_map<std::string, BreakpointFile> Breakpoints; // key is SourceRegistry::ExternalKey(SourceExternal), use GetBreakpointFile
 
 		std::mutex StatesMutex;
 
-		inline const std::vector<DebugState>& GetStates() const {
+		// iterating requires StatesMutex
+		inline const DebugStateTable& GetStates() const {
 			return States;
 		}
 		DebugState& GetState(lua_State* l);
-		int GetStateIndex(const DebugState& s);
-		DebugState& GetState(int i);
+		DebugState& GetState(DebugStateHandle h);
 		void OnStateAdded(lua_State* l, const char* name, lua::CFunction shutdown);
 		void OnStateClosed(lua_State* l);
 		void OnBreak(lua_State* l);
 		void OnSourceLoaded(lua_State* L, const char* filename);
 		void OnShutdown(std::function<void()> cb);
 
+		// any thread, the hooks get updated on the shok thread
+		void SetHandler(IDebugEventHandler* h);
+		// same as SetHandler, but on the shok thread and the caller already holds StatesMutex
+		void SetHandlerLocked(IDebugEventHandler* h);
 		// remember to Get the task
 		void RunInSHoKThread(LuaExecutionTask& t);
+		// makes the hook execute the pending tasks, for when the shok thread does not get back to its message loop (infinite loops).
+		// may be called from any thread.
+		void Interrupt();
+		// any thread, the hooks get updated on the shok thread
 		void Command(Request r);
-		void RebuildBreakpoints();
+		// sampling profiler, results via GetProfiler. shok thread only (sets the hooks).
+		void StartProfiler(int interval);
+		void StopProfiler();
+		inline SamplingProfiler& GetProfiler() {
+			return Profiler;
+		}
+		// call profiler, results in DebugState::Calls. shok thread only.
+		void StartCallProfile();
+		void StopCallProfile();
+		inline bool IsCallProfiling() const {
+			return CallProfiling;
+		}
+		// call RebuildBreakpoints after modifying, otherwise the hook uses outdated breakpoints!
+		BreakpointFile& GetBreakpointFile(std::string_view sourceExternal);
+		void RebuildBreakpoints(const BreakpointFile& f);
 		void SetBreakSettings(BreakSettings s);
 
 		int EvaluateInContext(std::string_view s, lua::State L, int lvl);
@@ -177,11 +447,37 @@ namespace debug_lua {
 
 	private:
 		Source* SearchExternalUnsafe(std::string_view e, bool fileOnly = false);
-		bool IsIdentifier(std::string_view s);
+		const BreakpointLines* GetBreakpointLines(lua::State L, const char* src);
+		void BindBreakpoints(const Source& s, const BreakpointFile& f);
+		void PushEvalFunction(lua::State L, std::string_view expr);
+		void PushEvalEnvironment(lua::State L, int lvl);
+		static void DeactivateEvalEnvironment(lua::State L, int idx);
+		static int EvalTargetLevel(lua::State L);
+		// pushes the local/upvalue name of the frame at lvl (valueIdx == 0), or sets it to the value at valueIdx
+		static bool AccessFrameVariable(lua::State L, int lvl, std::string_view name, int valueIdx);
+		static int EvalIndex(lua::State L);
+		static int EvalNewIndex(lua::State L);
 		void CheckRun();
+		void SetHookContext(DebugState& s, bool open);
+		static HookContext* GetHookContext(lua_State* L);
 		void RunCallback();
+		// recomputes Mode and sets the hooks of all states. shok thread only (the hook reads the same state), under StatesMutex.
 		void CheckHooked();
-		void SetHooked(DebugState& s, bool h, bool imm);
+		// CheckHooked if on the shok thread, otherwise queues it as a task. under StatesMutex.
+		void ScheduleCheckHooked();
+		void SetHooked(DebugState& s, HookMode m, bool imm);
+		// everyInstruction adds a count hook with count 1, otherwise the profiler might add its own.
+		// the call profiler adds call/return.
+		void SetHook(lua::State L, lua::HookEvent e, bool everyInstruction);
+		void ArmFunctionLineHook(lua::State L, DebugState& s, lua::ActivationRecord ar);
+		void SetLineHookArmed(lua::State L, DebugState& s, bool arm);
+		// current call depth of s, only walks the stack if the tracked depth is unknown or outdated
+		int CurrentDepth(lua::State L, DebugState& s);
+		// updates the tracked depth on a call/return event and returns it
+		int TrackDepth(lua::State L, DebugState& s, lua::ActivationRecord ar);
+		bool FunctionMayHaveBreakpoint(lua::State L, const lua::DebugInfo& i);
+		// condition, hit count and logpoint of a breakpoint, true if it should pause
+		bool CheckBreakpointAction(lua::State L, const BreakpointAction* a);
 		void WaitForRequest();
 		void TranslateRequest(lua::State L);
 		void InitializeLua(lua::State L, bool mainmenu, lua::CFunction shutdown);
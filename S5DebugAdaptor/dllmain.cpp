@@ -74,7 +74,7 @@ extern "C" {
 		if (dbg.RemoveLuaState)
 			dbg.RemoveLuaState(L);
 		debugger.OnStateClosed(L);
-		if (debugger.GetStates().empty())
+		if (debugger.GetStates().Empty())
 			serv = nullptr;
 	}
 
@@ -0,0 +1,380 @@
+#include "pch.h"
+#include "profiler.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <format>
+#include <unordered_map>
+#include "debugger.h"
+#include "Hooks.h"
+#include "utility.h"
+
+static_assert((debug_lua::SamplingProfiler::RingSize & (debug_lua::SamplingProfiler::RingSize - 1)) == 0);
+static_assert((debug_lua::SamplingProfiler::InternTableSize & (debug_lua::SamplingProfiler::InternTableSize - 1)) == 0);
+static_assert((debug_lua::CallProfile::TableSize & (debug_lua::CallProfile::TableSize - 1)) == 0);
+
+debug_lua::SamplingProfiler::~SamplingProfiler()
+{
+	Stop();
+}
+
+void debug_lua::SamplingProfiler::Start(int interval)
+{
+	if (Ring == nullptr) {
+		// allocated once and kept, the hook might still be running a Sample from the last time it got started
+		Ring = std::make_unique<RawSample[]>(RingSize);
+		InternTable = std::make_unique<InternSlot[]>(InternTableSize);
+		Pool = std::make_unique<char[]>(PoolSize);
+		PoolOffsets = std::make_unique<uint32_t[]>(InternTableSize / 2);
+	}
+	Interval.store(std::max(interval, 1), std::memory_order_relaxed);
+	if (!Aggregator.joinable()) {
+		AggregatorStop = false;
+		Aggregator = std::thread{ [this]() {
+			while (!AggregatorStop.load(std::memory_order_relaxed)) {
+				std::this_thread::sleep_for(std::chrono::milliseconds{ 20 });
+				Drain();
+			}
+			} };
+	}
+	// publishes the buffers allocated above to the shok thread
+	Running.store(true, std::memory_order_release);
+}
+
+void debug_lua::SamplingProfiler::Stop()
+{
+	Running.store(false, std::memory_order_relaxed);
+	if (Aggregator.joinable()) {
+		AggregatorStop = true;
+		Aggregator.join();
+	}
+	if (Ring != nullptr)
+		Drain();
+}
+
+uint32_t debug_lua::SamplingProfiler::Intern(const char* s)
+{
+	if (s == nullptr)
+		return 0;
+	// lua strings are interned, so the pointer is enough to find it. it might get reused for a different string after a gc, so compare anyway.
+	size_t mask = InternTableSize - 1;
+	size_t h = (reinterpret_cast<uintptr_t>(s) >> 3) * 2654435761u;
+	for (size_t i = h & mask;; i = (i + 1) & mask) {
+		auto& slot = InternTable[i];
+		if (slot.Ptr == s && std::strcmp(Pool.get() + PoolOffsets[slot.Id], s) == 0)
+			return slot.Id;
+		if (slot.Ptr == nullptr || slot.Ptr == s) {
+			size_t len = std::strlen(s) + 1;
+			if (NextId >= InternTableSize / 2 || PoolUsed + len > PoolSize)
+				return 0;
+			std::memcpy(Pool.get() + PoolUsed, s, len);
+			PoolOffsets[NextId] = static_cast<uint32_t>(PoolUsed);
+			PoolUsed += len;
+			slot.Ptr = s;
+			slot.Id = NextId;
+			return NextId++;
+		}
+	}
+}
+
+void debug_lua::SamplingProfiler::Sample(lua::State L, const DebugState& s)
+{
+	uint32_t h = Head.load(std::memory_order_relaxed);
+	if (h - Tail.load(std::memory_order_acquire) >= RingSize) {
+		Dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	RawSample& r = Ring[h & (RingSize - 1)];
+	uint32_t n = 0;
+	lua::DebugInfo i{};
+	while (n < MaxFrames - 1 && L.Debug_GetStack(static_cast<int>(n), i, lua::DebugInfoOptions::Source, false)) {
+		bool c = i.What != nullptr && i.What == std::string_view{ "C" };
+		r.Frames[n] = FrameKey{ Intern(i.Source), c ? -1 : i.LineDefined };
+		++n;
+	}
+	r.Frames[n] = FrameKey{ Intern(s.Name), -2 };
+	r.Count = n + 1;
+	Head.store(h + 1, std::memory_order_release);
+}
+
+void debug_lua::SamplingProfiler::Drain()
+{
+	uint32_t t = Tail.load(std::memory_order_relaxed);
+	uint32_t h = Head.load(std::memory_order_acquire);
+	if (t == h)
+		return;
+	std::lock_guard<std::mutex> lock(AggregateMutex);
+	std::vector<FrameKey> st{};
+	for (; t != h; ++t) {
+		const RawSample& r = Ring[t & (RingSize - 1)];
+		st.assign(std::make_reverse_iterator(r.Frames + r.Count), std::make_reverse_iterator(r.Frames));
+		++Stacks[st];
+		++Samples;
+	}
+	Tail.store(h, std::memory_order_release);
+}
+
+void debug_lua::SamplingProfiler::Reset()
+{
+	std::lock_guard<std::mutex> lock(AggregateMutex);
+	Stacks.clear();
+	Samples = 0;
+	Dropped = 0;
+}
+
+uint64_t debug_lua::SamplingProfiler::GetSampleCount()
+{
+	std::lock_guard<std::mutex> lock(AggregateMutex);
+	return Samples;
+}
+
+std::string debug_lua::SamplingProfiler::FrameName(FrameKey k) const
+{
+	std::string_view src = k.Source == 0 ? "?" : Pool.get() + PoolOffsets[k.Source];
+	if (src.starts_with('@') || src.starts_with('='))
+		src.remove_prefix(1);
+	if (k.LineDefined < 0)
+		return EnsureUTF8(src);
+	return std::format("{}:{}", EnsureUTF8(src), k.LineDefined);
+}
+
+static void AppendJSONString(std::string& out, std::string_view s)
+{
+	out.push_back('"');
+	for (char c : s) {
+		switch (c) {
+		case '"':
+			out.append("\\\"");
+			break;
+		case '\\':
+			out.append("\\\\");
+			break;
+		case '\n':
+			out.append("\\n");
+			break;
+		case '\r':
+			out.append("\\r");
+			break;
+		case '\t':
+			out.append("\\t");
+			break;
+		default:
+			if (static_cast<unsigned char>(c) < 0x20)
+				out.append(std::format("\\u{:04x}", static_cast<int>(c)));
+			else
+				out.push_back(c);
+			break;
+		}
+	}
+	out.push_back('"');
+}
+
+std::string debug_lua::SamplingProfiler::Export(Format f)
+{
+	std::lock_guard<std::mutex> lock(AggregateMutex);
+	// same names might have different ids (gc reused a pointer), they get merged here
+	std::map<FrameKey, std::string> names{};
+	auto name = [&](FrameKey k) -> const std::string& {
+		auto it = names.find(k);
+		if (it == names.end())
+			it = names.emplace(k, FrameName(k)).first;
+		return it->second;
+	};
+
+	std::string r{};
+	if (f == Format::Collapsed) {
+		for (const auto& [st, count] : Stacks) {
+			for (size_t i = 0; i < st.size(); ++i) {
+				if (i > 0)
+					r.push_back(';');
+				r.append(name(st[i]));
+			}
+			r.append(std::format(" {}\n", count));
+		}
+		return r;
+	}
+
+	std::unordered_map<std::string_view, size_t> frameIndex{};
+	std::vector<std::string_view> frames{};
+	auto index = [&](FrameKey k) {
+		const std::string& n = name(k);
+		auto [it, added] = frameIndex.emplace(n, frames.size());
+		if (added)
+			frames.push_back(n);
+		return it->second;
+	};
+	std::string samples{}, weights{};
+	for (const auto& [st, count] : Stacks) {
+		samples.append(samples.empty() ? "[" : ",[");
+		for (size_t i = 0; i < st.size(); ++i) {
+			if (i > 0)
+				samples.push_back(',');
+			samples.append(std::to_string(index(st[i])));
+		}
+		samples.push_back(']');
+		if (!weights.empty())
+			weights.push_back(',');
+		weights.append(std::to_string(count));
+	}
+
+	r = R"({"$schema":"https://www.speedscope.app/file-format-schema.json","shared":{"frames":[)";
+	for (size_t i = 0; i < frames.size(); ++i) {
+		if (i > 0)
+			r.push_back(',');
+		r.append(R"({"name":)");
+		AppendJSONString(r, frames[i]);
+		r.push_back('}');
+	}
+	r.append(std::format(R"(]}},"profiles":[{{"type":"sampled","name":"lua","unit":"none","startValue":0,"endValue":{},"samples":[)", Samples));
+	r.append(samples);
+	r.append(R"(],"weights":[)");
+	r.append(weights);
+	r.append("]}]}");
+	return r;
+}
+
+std::string debug_lua::CallProfile::Function::Name() const
+{
+	std::string_view src = Source;
+	if (src.starts_with('@') || src.starts_with('='))
+		src.remove_prefix(1);
+	if (LineDefined < 0)
+		return EnsureUTF8(src);
+	return std::format("{}:{}", EnsureUTF8(src), LineDefined);
+}
+
+debug_lua::CallProfile::CallProfile()
+	: Table(std::make_unique<Function[]>(TableSize)), Stack(std::make_unique<Frame[]>(MaxDepth))
+{
+	std::strcpy(Other.Source, "[other]");
+	Other.LineDefined = -1;
+}
+
+debug_lua::CallProfile::Function* debug_lua::CallProfile::Find(const char* src, int lineDefined)
+{
+	if (src == nullptr)
+		return &Other;
+	// lua strings are interned, all functions of a chunk share their source pointer.
+	// after a gc the pointer might get reused for a different chunk, IsSameSource keeps them apart.
+	size_t mask = TableSize - 1;
+	size_t h = ((reinterpret_cast<uintptr_t>(src) >> 3) ^ static_cast<uint32_t>(lineDefined) * 2246822519u) * 2654435761u;
+	for (size_t i = h & mask;; i = (i + 1) & mask) {
+		auto& f = Table[i];
+		if (f.Key == src && f.LineDefined == lineDefined && IsSameSource(f, src))
+			return &f;
+		if (f.Key == nullptr) {
+			if (Used >= TableSize / 4 * 3)
+				return &Other;
+			++Used;
+			f.Key = src;
+			f.LineDefined = lineDefined;
+			// keep the end, that is the file name
+			size_t len = std::strlen(src);
+			f.SourceSize = len;
+			if (len >= SourceLength)
+				src += len - (SourceLength - 1);
+			std::strncpy(f.Source, src, SourceLength - 1);
+			return &f;
+		}
+	}
+}
+
+bool debug_lua::CallProfile::IsSameSource(const Function& f, const char* src)
+{
+	// bounded by the stored length, src might be shorter
+	if (strnlen(src, f.SourceSize + 1) != f.SourceSize)
+		return false;
+	size_t stored = std::min(f.SourceSize, SourceLength - 1);
+	return std::memcmp(src + (f.SourceSize - stored), f.Source, stored) == 0;
+}
+
+// same as Debugger::TrackDepth, the level only gets walked if it is unknown or an error unwound the stack.
+int debug_lua::CallProfile::SyncLevel(lua::State L, bool& fresh)
+{
+	fresh = Level < 0 || LevelErrors != Hooks::PCallErrors;
+	if (fresh) {
+		Level = L.Debug_GetStackDepth();
+		LevelErrors = Hooks::PCallErrors;
+	}
+	return Level;
+}
+
+void debug_lua::CallProfile::Leave(Clock::time_point now)
+{
+	Frame& fr = Stack[--StackSize];
+	auto elapsed = now - fr.Start;
+	fr.F->Exclusive += elapsed - fr.Children;
+	if (--fr.F->Active == 0)
+		fr.F->Inclusive += elapsed;
+	if (StackSize > 0)
+		Stack[StackSize - 1].Children += elapsed;
+}
+
+void debug_lua::CallProfile::OnCall(lua::State L, lua::ActivationRecord ar, Clock::time_point now)
+{
+	bool fresh;
+	int lvl = SyncLevel(L, fresh); // if freshly synchronized, it contains the called function already
+	if (!fresh)
+		++lvl;
+	Level = lvl;
+	// frames at or below this level got unwound by an error, account them up to now
+	while (StackSize > 0 && Stack[StackSize - 1].Level >= lvl)
+		Leave(now);
+
+	auto i = L.Debug_GetInfoFromAR(ar, lua::DebugInfoOptions::Source);
+	bool c = i.What != nullptr && i.What == std::string_view{ "C" };
+	Function* f = Find(c ? "=[C]" : i.Source, c ? -1 : i.LineDefined);
+	++f->Calls;
+	if (StackSize >= MaxDepth)
+		return;
+	++f->Active;
+	Stack[StackSize++] = Frame{ f, now, Clock::duration{}, lvl };
+}
+
+// lua 5.0 sends a call event for a tail call without a return for the caller, and one tail return for each of them later.
+// so every return event pops exactly one frame, the tail caller includes the time of its tail callee.
+void debug_lua::CallProfile::OnReturn(lua::State L, Clock::time_point now)
+{
+	bool fresh;
+	int lvl = SyncLevel(L, fresh); // the returning function is still on the stack
+	while (StackSize > 0 && Stack[StackSize - 1].Level > lvl)
+		Leave(now);
+	// no frame if it was called before profiling started (or too deep)
+	if (StackSize > 0 && Stack[StackSize - 1].Level == lvl)
+		Leave(now);
+	Level = lvl - 1;
+}
+
+void debug_lua::CallProfile::ClearStack()
+{
+	for (size_t i = 0; i < StackSize; ++i)
+		--Stack[i].F->Active;
+	StackSize = 0;
+	Level = -1;
+}
+
+void debug_lua::CallProfile::Reset()
+{
+	for (size_t i = 0; i < TableSize; ++i)
+		Table[i] = Function{};
+	Used = 0;
+	Other.Calls = 0;
+	Other.Inclusive = Clock::duration{};
+	Other.Exclusive = Clock::duration{};
+	Other.Active = 0;
+	StackSize = 0;
+	Level = -1;
+}
+
+std::vector<const debug_lua::CallProfile::Function*> debug_lua::CallProfile::GetFunctions() const
+{
+	std::vector<const Function*> r{};
+	r.reserve(Used + 1);
+	for (size_t i = 0; i < TableSize; ++i) {
+		if (Table[i].Key != nullptr)
+			r.push_back(&Table[i]);
+	}
+	if (Other.Calls > 0)
+		r.push_back(&Other);
+	return r;
+}
@@ -0,0 +1,160 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "luapp/luapp50.h"
+
+namespace debug_lua {
+	class DebugState;
+
+	// samples the lua call stack every Interval vm instructions (count hook).
+	// Sample runs in the hook and never allocates: stacks go into a preallocated ring buffer, source names into a preallocated pool.
+	// a background thread drains the ring buffer and aggregates identical stacks.
+	class SamplingProfiler {
+	public:
+		static constexpr int DefaultInterval = 10000;
+		static constexpr size_t MaxFrames = 64; // deeper stacks get cut off at the root
+		static constexpr size_t RingSize = 4096; // samples, has to be a power of 2
+		static constexpr size_t InternTableSize = 8192; // has to be a power of 2
+		static constexpr size_t PoolSize = 1024 * 1024;
+
+		enum class Format : int {
+			Collapsed, // folded stacks, one line per stack: root;...;leaf count
+			Speedscope, // https://www.speedscope.app/file-format-schema.json
+		};
+
+		SamplingProfiler() = default;
+		SamplingProfiler(const SamplingProfiler&) = delete;
+		SamplingProfiler(SamplingProfiler&&) = delete;
+		void operator=(const SamplingProfiler&) = delete;
+		void operator=(SamplingProfiler&&) = delete;
+		~SamplingProfiler();
+
+		// use Debugger::StartProfiler/StopProfiler, they also set the hooks
+		void Start(int interval);
+		void Stop();
+		// acquire pairs with the release in Start, so the buffers are visible once this returns true
+		inline bool IsRunning() const {
+			return Running.load(std::memory_order_acquire);
+		}
+		inline int GetInterval() const {
+			return Interval.load(std::memory_order_relaxed);
+		}
+
+		// shok thread only (from the hook)
+		void Sample(lua::State L, const DebugState& s);
+
+		// thread safe
+		void Reset();
+		std::string Export(Format f);
+		uint64_t GetSampleCount();
+		uint64_t GetDroppedCount() const {
+			return Dropped.load(std::memory_order_relaxed);
+		}
+
+	private:
+		struct FrameKey {
+			uint32_t Source; // intern id
+			int32_t LineDefined; // -1 for C functions, -2 for the DebugState root
+
+			auto operator<=>(const FrameKey&) const noexcept = default;
+		};
+		struct RawSample {
+			uint32_t Count;
+			FrameKey Frames[MaxFrames]; // leaf first
+		};
+		struct InternSlot {
+			const char* Ptr = nullptr;
+			uint32_t Id = 0;
+		};
+
+		std::atomic<bool> Running = false;
+		std::atomic<int> Interval = DefaultInterval;
+
+		// ring buffer, single producer (shok thread), single consumer (aggregator)
+		std::unique_ptr<RawSample[]> Ring;
+		std::atomic<uint32_t> Head = 0, Tail = 0;
+		std::atomic<uint64_t> Dropped = 0;
+
+		// intern pool, only written by the shok thread. entries never change once published via Head.
+		std::unique_ptr<InternSlot[]> InternTable;
+		std::unique_ptr<char[]> Pool;
+		std::unique_ptr<uint32_t[]> PoolOffsets; // id -> offset into Pool
+		size_t PoolUsed = 0;
+		uint32_t NextId = 1; // 0 is unknown
+
+		std::mutex AggregateMutex;
+		std::map<std::vector<FrameKey>, uint64_t> Stacks; // root first
+		uint64_t Samples = 0;
+
+		std::thread Aggregator;
+		std::atomic<bool> AggregatorStop = false;
+
+		uint32_t Intern(const char* s);
+		void Drain();
+		std::string FrameName(FrameKey k) const;
+	};
+
+	// call counts and inclusive/exclusive time per lua function of one DebugState, from call/return hook events.
+	// functions are keyed by source + LineDefined (all C functions share one entry).
+	// everything is allocated up front, OnCall/OnReturn never allocate. shok thread only.
+	class CallProfile {
+	public:
+		using Clock = std::chrono::steady_clock;
+		static constexpr size_t TableSize = 4096; // has to be a power of 2, filled at most to 3/4, the rest gets counted as [other]
+		static constexpr size_t MaxDepth = 512; // deeper calls get counted, but not timed
+		static constexpr size_t SourceLength = 96;
+
+		struct Function {
+			const char* Key = nullptr; // interned lua source, nullptr if the slot is free
+			int LineDefined = 0; // -1 for C functions
+			uint64_t Calls = 0;
+			Clock::duration Inclusive{}, Exclusive{};
+			int Active = 0; // running instances, recursive calls only count once into Inclusive
+			char Source[SourceLength]{}; // copy of the end of Key, Key might get collected
+			size_t SourceSize = 0; // strlen of Key
+
+			std::string Name() const;
+		};
+
+		CallProfile();
+
+		// now excludes time spent paused in the debugger
+		void OnCall(lua::State L, lua::ActivationRecord ar, Clock::time_point now);
+		void OnReturn(lua::State L, Clock::time_point now);
+		// forgets the running functions (missed events), keeps the results
+		void ClearStack();
+		void Reset();
+		// used entries, unordered
+		std::vector<const Function*> GetFunctions() const;
+
+	private:
+		struct Frame {
+			Function* F;
+			Clock::time_point Start;
+			Clock::duration Children;
+			int Level;
+		};
+
+		std::unique_ptr<Function[]> Table;
+		size_t Used = 0;
+		Function Other{};
+		std::unique_ptr<Frame[]> Stack;
+		size_t StackSize = 0;
+		int Level = -1; // call depth of the last event, -1 if unknown
+		unsigned int LevelErrors = 0; // Hooks::PCallErrors when Level was last synchronized
+
+		Function* Find(const char* src, int lineDefined);
+		// the pointer alone could also be a different chunk that got allocated at the same address after a gc
+		static bool IsSameSource(const Function& f, const char* src);
+		void Leave(Clock::time_point now);
+		int SyncLevel(lua::State L, bool& fresh);
+	};
+}
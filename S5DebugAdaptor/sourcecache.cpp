@@ -0,0 +1,78 @@
+#include "pch.h"
+#include "sourcecache.h"
+#include <filesystem>
+
+std::optional<int64_t> debug_lua::SourceContentCache::ArchiveTime(std::string_view archive)
+{
+	std::error_code ec{};
+	auto t = std::filesystem::last_write_time(std::filesystem::path(archive, std::filesystem::path::native_format), ec);
+	if (ec)
+		return std::nullopt;
+	return static_cast<int64_t>(t.time_since_epoch().count());
+}
+
+std::string debug_lua::SourceContentCache::MakeKey(std::string_view archive, std::string_view file)
+{
+	std::string k{ archive };
+	k.push_back('\n');
+	k.append(file);
+	return k;
+}
+
+std::shared_ptr<const std::string> debug_lua::SourceContentCache::Get(std::string_view archive, std::string_view file, int64_t archiveTime)
+{
+	std::string k = MakeKey(archive, file);
+	std::lock_guard<std::mutex> lock(Mutex);
+	auto it = Index.find(k);
+	if (it == Index.end())
+		return nullptr;
+	auto e = it->second;
+	if (e->ArchiveTime != archiveTime) {
+		// archive got replaced, the file might be different now
+		Bytes -= e->Content->size();
+		Index.erase(it);
+		Entries.erase(e);
+		return nullptr;
+	}
+	Entries.splice(Entries.begin(), Entries, e);
+	return e->Content;
+}
+
+void debug_lua::SourceContentCache::Put(std::string_view archive, std::string_view file, int64_t archiveTime, uint64_t timestamp, std::string content)
+{
+	if (content.size() > MaxBytes)
+		return;
+	std::string k = MakeKey(archive, file);
+	std::lock_guard<std::mutex> lock(Mutex);
+	auto it = Index.find(k);
+	if (it != Index.end()) {
+		auto e = it->second;
+		if (e->ArchiveTime == archiveTime && e->Timestamp == timestamp)
+			return;
+		Bytes -= e->Content->size();
+		Index.erase(it);
+		Entries.erase(e);
+	}
+	Bytes += content.size();
+	Entries.push_front(Entry{ std::move(k), archiveTime, timestamp, std::make_shared<const std::string>(std::move(content)) });
+	Index.emplace(Entries.front().Key, Entries.begin());
+	Evict();
+}
+
+void debug_lua::SourceContentCache::Clear()
+{
+	std::lock_guard<std::mutex> lock(Mutex);
+	Index.clear();
+	Entries.clear();
+	Bytes = 0;
+}
+
+void debug_lua::SourceContentCache::Evict()
+{
+	while (!Entries.empty() && (Bytes > MaxBytes || Entries.size() > MaxEntries)) {
+		auto& e = Entries.back();
+		Bytes -= e.Content->size();
+		Index.erase(e.Key);
+		Entries.pop_back();
+	}
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace debug_lua {
+	// decoded (utf8) contents of scripts inside bba archives, so repeated SourceRequests do not need to go through the shok thread.
+	// an entry is valid as long as the archive file on disk did not change. thread safe.
+	class SourceContentCache {
+	public:
+		static constexpr size_t MaxBytes = 16 * 1024 * 1024;
+		static constexpr size_t MaxEntries = 64;
+
+		// last write time of the archive file, nullopt if it cannot be checked (then nothing gets cached)
+		static std::optional<int64_t> ArchiveTime(std::string_view archive);
+
+		std::shared_ptr<const std::string> Get(std::string_view archive, std::string_view file, int64_t archiveTime);
+		// timestamp is DirectoryEntry::Timestamp of the file in the archive
+		void Put(std::string_view archive, std::string_view file, int64_t archiveTime, uint64_t timestamp, std::string content);
+		void Clear();
+
+	private:
+		struct Entry {
+			std::string Key;
+			int64_t ArchiveTime;
+			uint64_t Timestamp;
+			std::shared_ptr<const std::string> Content;
+		};
+		std::mutex Mutex;
+		std::list<Entry> Entries; // most recently used first
+		std::unordered_map<std::string_view, std::list<Entry>::iterator> Index; // keys point into Entry::Key
+		size_t Bytes = 0;
+
+		static std::string MakeKey(std::string_view archive, std::string_view file);
+		void Evict();
+	};
+}
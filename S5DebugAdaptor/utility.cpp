@@ -52,6 +52,10 @@ std::string debug_lua::ANSIToUTF8(std::string_view data)
 {
 	if (data.empty())
 		return "";
+	if (IsASCII(data))
+		return std::string{ data };
+	if (const auto* cp = SingleByteCodePage::ANSI())
+		return cp->ToUTF8(data);
 
 	return To8<CP_UTF8>(To16<CP_ACP>(data));
 }
@@ -60,13 +64,73 @@ std::string debug_lua::UTF8ToANSI(std::string_view data)
 {
 	if (data.empty())
 		return "";
+	if (IsASCII(data))
+		return std::string{ data };
+	if (const auto* cp = SingleByteCodePage::ANSI())
+		return cp->FromUTF8(data);
 
 	return To8<CP_ACP>(To16<CP_UTF8>(data));
 }
 
 std::string debug_lua::EnsureUTF8(std::string_view data)
 {
-	if (una::is_valid_utf8(data))
-		return std::string{ data };
-	return una::norm::to_nfc_utf8(data);
+	std::string buff{};
+	auto r = EnsureUTF8View(data, buff);
+	if (r.data() == buff.data())
+		return buff;
+	return std::string{ r };
+}
+
+std::string_view debug_lua::EnsureUTF8View(std::string_view data, std::string& buffer)
+{
+	// nearly all game strings are ascii, so check that first, its a lot cheaper than full validation
+	if (IsASCII(data) || una::is_valid_utf8(data))
+		return data;
+	buffer.clear();
+	// not utf8, so it is most likely a string from the game in its code page
+	if (const auto* cp = SingleByteCodePage::ANSI())
+		cp->AppendUTF8(data, buffer);
+	else
+		buffer = una::norm::to_nfc_utf8(data);
+	return buffer;
+}
+
+void debug_lua::EnsureUTF8InPlace(std::string& data)
+{
+	if (IsASCII(data) || una::is_valid_utf8(data))
+		return;
+	if (const auto* cp = SingleByteCodePage::ANSI())
+		data = cp->ToUTF8(data);
+	else
+		data = una::norm::to_nfc_utf8(data);
+}
+
+debug_lua::EnsureUTF8Stream::EnsureUTF8Stream(std::string& out)
+	: Out(out), Start(out.size())
+{
+	if (const auto* cp = SingleByteCodePage::ANSI())
+		Decoder.emplace(*cp, out);
+}
+
+void debug_lua::EnsureUTF8Stream::Append(std::string_view chunk)
+{
+	if (Decoder)
+		Decoder->Append(chunk);
+	else
+		Out.append(chunk);
+}
+
+void debug_lua::EnsureUTF8Stream::Finish()
+{
+	if (Decoder) {
+		Decoder->Finish();
+		return;
+	}
+	if (Start == 0) {
+		EnsureUTF8InPlace(Out);
+		return;
+	}
+	auto tail = Out.substr(Start);
+	EnsureUTF8InPlace(tail);
+	Out.replace(Start, std::string::npos, tail);
 }
@@ -1,7 +1,12 @@
 #pragma once
+#include <array>
+#include <cstdint>
+#include <optional>
 #include <string_view>
 #include <string>
 
+#include "codepage.h"
+
 namespace debug_lua {
 	class EnsureBbaLoaded {
 		bool NeedsPop = false;
@@ -19,4 +24,69 @@ namespace debug_lua {
 	std::string UTF8ToANSI(std::string_view data);
 
 	std::string EnsureUTF8(std::string_view data);
+	// returns data itself if it is valid utf8 already (no copy), otherwise converts into buffer and returns that
+	std::string_view EnsureUTF8View(std::string_view data, std::string& buffer);
+	// for big buffers (file contents), only replaces data if it needs to be converted
+	void EnsureUTF8InPlace(std::string& data);
+
+	// EnsureUTF8 for data read in chunks, appends to out.
+	// converts chunk by chunk with the ANSI code page (see UTF8ChunkDecoder), otherwise everything at once in Finish.
+	class EnsureUTF8Stream {
+		std::string& Out;
+		size_t Start;
+		std::optional<UTF8ChunkDecoder> Decoder;
+
+	public:
+		explicit EnsureUTF8Stream(std::string& out);
+		void Append(std::string_view chunk);
+		void Finish();
+	};
+
+	namespace lua_names {
+		enum CharClass : uint8_t {
+			None = 0,
+			Start = 1, // a-z A-Z _
+			Continue = 2, // Start + 0-9
+		};
+		constexpr std::array<uint8_t, 256> CharClasses = [] {
+			std::array<uint8_t, 256> r{};
+			for (int c = 'a'; c <= 'z'; ++c)
+				r[c] = Start | Continue;
+			for (int c = 'A'; c <= 'Z'; ++c)
+				r[c] = Start | Continue;
+			for (int c = '0'; c <= '9'; ++c)
+				r[c] = Continue;
+			r['_'] = Start | Continue;
+			return r;
+		}();
+		// lua 5.0 reserved words
+		constexpr std::array<std::string_view, 21> Keywords{
+			"and", "break", "do", "else", "elseif", "end", "false", "for", "function", "if", "in",
+			"local", "nil", "not", "or", "repeat", "return", "then", "true", "until", "while",
+		};
+	}
+
+	constexpr bool IsLuaKeyword(std::string_view s) {
+		// all keywords are 2-8 lowercase letters
+		if (s.size() < 2 || s.size() > 8 || s[0] < 'a' || s[0] > 'w')
+			return false;
+		for (std::string_view k : lua_names::Keywords) {
+			if (k == s)
+				return true;
+		}
+		return false;
+	}
+	// true if s can be used as a name in lua code: [a-zA-Z_][a-zA-Z_0-9]* and not a reserved word
+	constexpr bool IsLuaIdentifier(std::string_view s) {
+		if (s.empty() || !(lua_names::CharClasses[static_cast<uint8_t>(s[0])] & lua_names::Start))
+			return false;
+		for (char c : s.substr(1)) {
+			if (!(lua_names::CharClasses[static_cast<uint8_t>(c)] & lua_names::Continue))
+				return false;
+		}
+		return !IsLuaKeyword(s);
+	}
+	static_assert(IsLuaIdentifier("a") && IsLuaIdentifier("_G") && IsLuaIdentifier("x1_y") && IsLuaIdentifier("ends"));
+	static_assert(!IsLuaIdentifier("") && !IsLuaIdentifier("1a") && !IsLuaIdentifier("(for index)") && !IsLuaIdentifier("a.b"));
+	static_assert(!IsLuaIdentifier("end") && !IsLuaIdentifier("function") && !IsLuaIdentifier("nil") && !IsLuaIdentifier("\xE4"));
 }
\ No newline at end of file
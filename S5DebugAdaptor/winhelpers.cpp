@@ -1,6 +1,8 @@
 #include "pch.h"
 #include "winhelpers.h"
 #include <cstdlib>
+#include <memory>
+#include "codepage.h"
 
 void debug_lua::ProcessBasicWindowEvents()
 {
@@ -18,3 +20,40 @@ void debug_lua::ProcessBasicWindowEvents()
 		DispatchMessageA(&msg);
 	}
 }
+
+debug_lua::WakeEvent::WakeEvent()
+{
+	Handle = CreateEventA(nullptr, FALSE, FALSE, nullptr);
+}
+debug_lua::WakeEvent::~WakeEvent()
+{
+	CloseHandle(Handle);
+}
+void debug_lua::WakeEvent::Set()
+{
+	SetEvent(Handle);
+}
+void debug_lua::WakeEvent::WaitOrMessage()
+{
+	MsgWaitForMultipleObjects(1, &Handle, FALSE, INFINITE, QS_ALLINPUT);
+}
+
+const debug_lua::SingleByteCodePage* debug_lua::SingleByteCodePage::ANSI()
+{
+	static const std::unique_ptr<SingleByteCodePage> cp = []() -> std::unique_ptr<SingleByteCodePage> {
+		CPINFO inf{};
+		if (!GetCPInfo(CP_ACP, &inf) || inf.MaxCharSize != 1)
+			return nullptr;
+		std::array<char32_t, 256> table{};
+		for (int b = 0; b < 256; ++b) {
+			char c = static_cast<char>(b);
+			wchar_t w = 0;
+			if (MultiByteToWideChar(CP_ACP, MB_ERR_INVALID_CHARS, &c, 1, &w, 1) == 1)
+				table[b] = w;
+			else
+				table[b] = Invalid;
+		}
+		return std::make_unique<SingleByteCodePage>(table);
+	}();
+	return cp.get();
+}
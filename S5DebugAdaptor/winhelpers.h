@@ -2,4 +2,21 @@
 
 namespace debug_lua {
 	void ProcessBasicWindowEvents();
+
+	// auto reset win32 event, that can be waited on together with the window message queue
+	class WakeEvent {
+		HANDLE Handle;
+
+	public:
+		WakeEvent();
+		~WakeEvent();
+		WakeEvent(const WakeEvent&) = delete;
+		WakeEvent(WakeEvent&&) = delete;
+		void operator=(const WakeEvent&) = delete;
+		void operator=(WakeEvent&&) = delete;
+
+		void Set();
+		// blocks until Set gets called or a new window message arrives
+		void WaitOrMessage();
+	};
 }
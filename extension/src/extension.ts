@@ -8,6 +8,14 @@ import * as vscode from 'vscode';
 export function activate(context: vscode.ExtensionContext) {
 
 	context.subscriptions.push(vscode.debug.registerDebugAdapterDescriptorFactory('s5lua', new S5DebugAdapterDescriptorFactory()));
+	context.subscriptions.push(vscode.commands.registerCommand('s5lua.profilerStart', () => profilerCommand('start')));
+	context.subscriptions.push(vscode.commands.registerCommand('s5lua.profilerStop', () => profilerCommand('stop')));
+	context.subscriptions.push(vscode.commands.registerCommand('s5lua.profilerReset', () => profilerCommand('reset')));
+	context.subscriptions.push(vscode.commands.registerCommand('s5lua.profilerExport', profilerExport));
+	context.subscriptions.push(vscode.commands.registerCommand('s5lua.callProfileStart', () => callProfileCommand('start')));
+	context.subscriptions.push(vscode.commands.registerCommand('s5lua.callProfileStop', () => callProfileCommand('stop')));
+	context.subscriptions.push(vscode.commands.registerCommand('s5lua.callProfileReset', () => callProfileCommand('reset')));
+	context.subscriptions.push(vscode.commands.registerCommand('s5lua.callProfileShow', callProfileShow));
 }
 
 // This method is called when your extension is deactivated
@@ -30,3 +38,67 @@ class S5DebugAdapterDescriptorFactory implements vscode.DebugAdapterDescriptorFa
 		return new Promise(resolve => setTimeout(resolve, ms));
 	}
 }
+
+function getSession(): vscode.DebugSession | undefined {
+	let session = vscode.debug.activeDebugSession;
+	if (!session || session.type !== 's5lua') {
+		vscode.window.showErrorMessage("no active S5 Lua debug session");
+		return undefined;
+	}
+	return session;
+}
+
+async function profilerCommand(command: string) {
+	let session = getSession();
+	if (!session) {
+		return;
+	}
+	let r = await session.customRequest('s5profiler', { command: command });
+	vscode.window.showInformationMessage(`profiler ${r.running ? "running" : "stopped"}, ${r.samples} samples (${r.dropped} dropped)`);
+}
+
+async function profilerExport() {
+	let session = getSession();
+	if (!session) {
+		return;
+	}
+	let format = await vscode.window.showQuickPick(["speedscope", "collapsed"], { placeHolder: "profile format" });
+	if (!format) {
+		return;
+	}
+	let uri = await vscode.window.showSaveDialog({
+		filters: format === "speedscope" ? { "speedscope": ["speedscope.json", "json"] } : { "collapsed stacks": ["folded", "txt"] },
+	});
+	if (!uri) {
+		return;
+	}
+	let r = await session.customRequest('s5profiler', { command: "export", format: format });
+	await vscode.workspace.fs.writeFile(uri, Buffer.from(r.data ?? "", 'utf8'));
+}
+
+async function callProfileCommand(command: string) {
+	let session = getSession();
+	if (!session) {
+		return;
+	}
+	let r = await session.customRequest('s5callprofile', { command: command });
+	vscode.window.showInformationMessage(`call profiler ${r.running ? "running" : "stopped"}`);
+}
+
+async function callProfileShow() {
+	let session = getSession();
+	if (!session) {
+		return;
+	}
+	let r = await session.customRequest('s5callprofile', { command: "get" });
+	let text = "";
+	for (let st of r.states) {
+		text += `${st.name}\n${"calls".padStart(10)} ${"incl ms".padStart(12)} ${"excl ms".padStart(12)}  function\n`;
+		for (let f of st.functions) {
+			text += `${String(f.calls).padStart(10)} ${f.inclusive.toFixed(3).padStart(12)} ${f.exclusive.toFixed(3).padStart(12)}  ${f.name}\n`;
+		}
+		text += "\n";
+	}
+	let doc = await vscode.workspace.openTextDocument({ content: text });
+	await vscode.window.showTextDocument(doc);
+}
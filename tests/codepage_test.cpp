@@ -0,0 +1,69 @@
+// SingleByteCodePage table test, needs nothing from windows or the game.
+// g++ -std=c++20 -I../S5DebugAdaptor codepage_test.cpp ../S5DebugAdaptor/codepage.cpp -o codepage_test && ./codepage_test
+#include <array>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include "codepage.h"
+
+static int Failed = 0;
+
+static void Check(bool ok, const char* what)
+{
+	if (!ok) {
+		std::printf("FAILED: %s\n", what);
+		++Failed;
+	}
+}
+
+// windows-1252, 0x80-0x9F differ from latin1 and have holes
+static std::array<char32_t, 256> Windows1252()
+{
+	static constexpr char32_t high[32] = {
+		0x20AC, 0, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021, 0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0, 0x017D, 0,
+		0, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014, 0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0, 0x017E, 0x0178,
+	};
+	std::array<char32_t, 256> t{};
+	for (int b = 0; b < 256; ++b) {
+		if (b >= 0x80 && b < 0xA0)
+			t[b] = high[b - 0x80] == 0 ? debug_lua::SingleByteCodePage::Invalid : high[b - 0x80];
+		else
+			t[b] = static_cast<char32_t>(b);
+	}
+	return t;
+}
+
+int main()
+{
+	debug_lua::SingleByteCodePage cp{ Windows1252() };
+
+	Check(cp.ToUTF8("plain ascii") == "plain ascii", "ascii is unchanged");
+	Check(cp.ToUTF8("\xE4\xF6\xFC\xDF") == "\xC3\xA4\xC3\xB6\xC3\xBC\xC3\x9F", "latin1 range becomes 2 byte sequences");
+	Check(cp.ToUTF8("\x80") == "\xE2\x82\xAC", "euro sign becomes a 3 byte sequence");
+	Check(cp.ToUTF8("\x81") == "\xEF\xBF\xBD", "undefined byte becomes U+FFFD");
+	Check(cp.ToUTF8(std::string_view{ "a\0b", 3 }) == std::string_view{ "a\0b", 3 }, "embedded 0 is kept");
+
+	std::string out = "x";
+	cp.AppendUTF8("\xE4", out);
+	Check(out == "x\xC3\xA4", "AppendUTF8 appends");
+
+	bool roundtrip = true;
+	for (int b = 1; b < 256; ++b) {
+		if (b == 0x81 || b == 0x8D || b == 0x8F || b == 0x90 || b == 0x9D)
+			continue;
+		std::string s(1, static_cast<char>(b));
+		if (cp.FromUTF8(cp.ToUTF8(s)) != s)
+			roundtrip = false;
+	}
+	Check(roundtrip, "every defined byte round trips");
+
+	Check(cp.FromUTF8("\xE2\x82\xAC") == "\x80", "euro sign back to 0x80");
+	Check(cp.FromUTF8("\xE4\xB8\xAD") == "?", "character outside the code page becomes ?");
+	Check(cp.FromUTF8("\xC3") == "?", "truncated sequence becomes ?");
+	Check(cp.FromUTF8("\xC3x") == "?x", "broken sequence becomes ? and continues");
+	Check(cp.FromUTF8("\x80") == "?", "stray continuation byte becomes ?");
+
+	if (Failed == 0)
+		std::printf("all passed\n");
+	return Failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,89 @@
+// IsLuaIdentifier/IsLuaKeyword against the std::regex check they replaced, with a small benchmark.
+// only uses the constexpr part of utility.h, needs nothing from windows or the game.
+// g++ -std=c++20 -O2 -I../S5DebugAdaptor identifier_test.cpp -o identifier_test && ./identifier_test
+#include <chrono>
+#include <cstdio>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "utility.h"
+
+static int Failed = 0;
+
+static void Check(bool ok, const char* what)
+{
+	if (!ok) {
+		std::printf("FAILED: %s\n", what);
+		++Failed;
+	}
+}
+
+// the old Debugger::IsIdentifier
+static bool RegexIdentifier(std::string_view s)
+{
+	static std::regex reg{ "^[a-zA-Z_][a-zA-Z_0-9]*$", std::regex_constants::ECMAScript | std::regex_constants::optimize };
+	return std::regex_match(s.begin(), s.end(), reg);
+}
+
+// names as the evaluation environment sees them: locals, globals, table keys, temporaries
+static std::vector<std::string> Names()
+{
+	std::vector<std::string> r{
+		"a", "_G", "self", "x1_y", "Logic", "GetPosition", "ends", "endx", "nil_", "(for index)", "(for limit)",
+		"", "1a", "a.b", "a b", "\xE4", "\xC3\xA4", "end", "function", "nil", "while", "in", "elseif", "or",
+		"VeryLongIdentifierNameThatIsProbablyAFunction_InSomeFrameworkTable",
+	};
+	for (int i = 0; i < 64; ++i)
+		r.push_back("var" + std::to_string(i));
+	return r;
+}
+
+template<class F>
+static double Measure(const std::vector<std::string>& names, int rounds, F&& f, int& matches)
+{
+	matches = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < rounds; ++i) {
+		for (const auto& n : names) {
+			if (f(n))
+				++matches;
+		}
+	}
+	auto d = std::chrono::steady_clock::now() - start;
+	return std::chrono::duration<double, std::nano>(d).count() / (static_cast<double>(rounds) * names.size());
+}
+
+int main()
+{
+	auto names = Names();
+
+	bool same = true;
+	for (const auto& n : names) {
+		bool expected = RegexIdentifier(n) && !debug_lua::IsLuaKeyword(n);
+		if (debug_lua::IsLuaIdentifier(n) != expected) {
+			std::printf("mismatch: '%s'\n", n.c_str());
+			same = false;
+		}
+	}
+	Check(same, "IsLuaIdentifier is the regex minus reserved words");
+
+	bool keywords = true;
+	for (std::string_view k : debug_lua::lua_names::Keywords) {
+		if (!debug_lua::IsLuaKeyword(k) || !RegexIdentifier(k) || debug_lua::IsLuaIdentifier(k))
+			keywords = false;
+	}
+	Check(keywords, "every keyword matches the regex, but is no identifier");
+	Check(!debug_lua::IsLuaKeyword("End") && !debug_lua::IsLuaKeyword("ends") && !debug_lua::IsLuaKeyword("e"), "keywords are exact and case sensitive");
+
+	constexpr int rounds = 20000;
+	int regexMatches = 0, tableMatches = 0;
+	double regex = Measure(names, rounds, [](const std::string& n) { return RegexIdentifier(n) && !debug_lua::IsLuaKeyword(n); }, regexMatches);
+	double table = Measure(names, rounds, [](const std::string& n) { return debug_lua::IsLuaIdentifier(n); }, tableMatches);
+	Check(regexMatches == tableMatches, "benchmark loops agree");
+	std::printf("regex: %.1f ns/name, IsLuaIdentifier: %.1f ns/name (%.0fx)\n", regex, table, regex / table);
+
+	if (Failed == 0)
+		std::printf("all passed\n");
+	return Failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,27 @@
+-- pcall overhead at different stack depths, needs the game (run it from a map script or the debug console).
+-- compare the results with break on pcall errors off and on, that is when the debugger hooks pcall.
+-- a pcall should cost the same at every depth, the stack only gets walked if an error gets caught.
+local clock = os and os.clock or XGUIEng.GetSystemTime
+local N = 100000
+
+local function Nest(d, f)
+	if d == 0 then
+		return f()
+	end
+	return (Nest(d - 1, f)) -- no tail call, so every level is a real frame
+end
+
+local function Run(depth)
+	local ok = function() end
+	return Nest(depth, function()
+		local t = clock()
+		for i = 1, N do
+			pcall(ok)
+		end
+		return clock() - t
+	end)
+end
+
+for _, depth in ipairs({ 0, 10, 50, 200 }) do
+	LuaDebugger.Log(string.format("depth %d: %.3f us per pcall", depth, Run(depth) * 1000000 / N))
+end
@@ -0,0 +1,111 @@
+// IsASCII, ValidUTF8Length and UTF8ChunkDecoder, with a small benchmark of the checks EnsureUTF8View does first.
+// EnsureUTF8View itself needs uni_algo and the windows code page, this covers everything below it.
+// g++ -std=c++20 -O2 -I../S5DebugAdaptor utf8_test.cpp ../S5DebugAdaptor/codepage.cpp -o utf8_test && ./utf8_test
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include "codepage.h"
+
+static int Failed = 0;
+
+static void Check(bool ok, const char* what)
+{
+	if (!ok) {
+		std::printf("FAILED: %s\n", what);
+		++Failed;
+	}
+}
+
+// latin1, enough to see what got converted
+static std::array<char32_t, 256> Latin1()
+{
+	std::array<char32_t, 256> t{};
+	for (int b = 0; b < 256; ++b)
+		t[b] = static_cast<char32_t>(b);
+	return t;
+}
+
+static size_t Valid(std::string_view s, bool& incomplete)
+{
+	return debug_lua::ValidUTF8Length(s, incomplete);
+}
+
+static std::string Decode(const debug_lua::SingleByteCodePage& cp, std::string_view s, size_t chunk)
+{
+	std::string out{};
+	debug_lua::UTF8ChunkDecoder d{ cp, out };
+	for (size_t i = 0; i < s.size(); i += chunk)
+		d.Append(s.substr(i, chunk));
+	d.Finish();
+	return out;
+}
+
+template<class F>
+static double Measure(int rounds, size_t bytes, F&& f)
+{
+	auto start = std::chrono::steady_clock::now();
+	size_t r = 0;
+	for (int i = 0; i < rounds; ++i)
+		r += f();
+	auto d = std::chrono::steady_clock::now() - start;
+	if (r == 42)
+		std::printf(" ");
+	return static_cast<double>(bytes) * rounds / std::chrono::duration<double>(d).count() / (1024.0 * 1024.0);
+}
+
+int main()
+{
+	debug_lua::SingleByteCodePage cp{ Latin1() };
+	bool inc;
+
+	Check(debug_lua::IsASCII("") && debug_lua::IsASCII("plain ascii, longer than sixteen bytes"), "ascii");
+	Check(!debug_lua::IsASCII("longer than sixteen bytes \xE4") && !debug_lua::IsASCII("\x80"), "high bit at the end and alone");
+
+	Check(Valid("abc", inc) == 3 && !inc, "ascii is valid");
+	Check(Valid("a\xC3\xA4\xE2\x82\xAC\xF0\x9F\x98\x80", inc) == 10 && !inc, "2, 3 and 4 byte sequences");
+	Check(Valid("a\xE2\x82", inc) == 1 && inc, "cut off sequence is incomplete");
+	Check(Valid("a\xE4 b", inc) == 1 && !inc, "latin1 byte is invalid");
+	Check(Valid("\xC0\xAF", inc) == 0 && !inc, "overlong is invalid");
+	Check(Valid("\xED\xA0\x80", inc) == 0 && !inc, "surrogate is invalid");
+	Check(Valid("\xF4\x90\x80\x80", inc) == 0 && !inc, "above U+10FFFF is invalid");
+	Check(Valid("\xE2\x28", inc) == 0 && !inc, "bad continuation is invalid, not incomplete");
+
+	std::string utf8 = "local s = \"\xC3\xA4\xC3\xB6\xC3\xBC \xE2\x82\xAC \xF0\x9F\x98\x80\"\n";
+	bool splits = true;
+	for (size_t c = 1; c <= utf8.size(); ++c) {
+		if (Decode(cp, utf8, c) != utf8)
+			splits = false;
+	}
+	Check(splits, "utf8 split at every position stays unchanged");
+
+	std::string ansi = "local s = \"\xE4\xF6\xFC\"\n";
+	Check(Decode(cp, ansi, ansi.size()) == cp.ToUTF8(ansi), "ansi gets converted");
+	Check(Decode(cp, "ab\xC3", 2) == "ab\xC3\x83", "sequence cut off at the end gets converted");
+	Check(Decode(cp, "\xC3x", 1) == "\xC3\x83x", "carried byte that does not continue gets converted");
+	Check(Decode(cp, "\xE2\x82\xAC", 1) == "\xE2\x82\xAC", "sequence carried over 3 chunks");
+
+	// a typical script: mostly ascii, some utf8 in strings and comments
+	std::string script{};
+	while (script.size() < 1024 * 1024)
+		script += "function Foo(a, b)\n\t-- K\xC3\xB6nig\n\treturn a + b\nend\n";
+	std::string ascii(script.size(), 'x');
+	constexpr int rounds = 50;
+
+	double bytewise = Measure(rounds, ascii.size(), [&]() {
+		size_t n = 0;
+		for (char c : ascii)
+			n += static_cast<unsigned char>(c) >> 7;
+		return n;
+		});
+	double isascii = Measure(rounds, ascii.size(), [&]() { return static_cast<size_t>(debug_lua::IsASCII(ascii)); });
+	double validate = Measure(rounds, script.size(), [&]() { bool i; return debug_lua::ValidUTF8Length(script, i); });
+	double chunked = Measure(rounds, script.size(), [&]() { return Decode(cp, script, 64 * 1024).size(); });
+	std::printf("ascii check: bytewise %.0f MiB/s, IsASCII %.0f MiB/s\n", bytewise, isascii);
+	std::printf("utf8 script: ValidUTF8Length %.0f MiB/s, UTF8ChunkDecoder (64 KiB chunks) %.0f MiB/s\n", validate, chunked);
+
+	if (Failed == 0)
+		std::printf("all passed\n");
+	return Failed == 0 ? 0 : 1;
+}